@@ -0,0 +1,1086 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Brendan Bolles
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// *	   Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// *	   Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+
+// ------------------------------------------------------------------------
+//
+// Decoded audio caches for the Ogg importer, in memory and on disk
+//
+// by Brendan Bolles <brendan@fnordware.com>
+//
+// ------------------------------------------------------------------------
+
+
+#include "Ogg_Premiere_Cache.h"
+
+#include "Ogg_Premiere_Channels.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef PRWIN_ENV
+#include <malloc.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#endif
+
+
+// Packed audio
+//
+// When a block falls out of the audio cache, we squeeze it into integers instead of
+// throwing it away.  Each channel is run through a simple second-order predictor and the
+// residuals are bit-packed in groups of 32 at the smallest width that fits.  Audio that
+// came from integers (FLAC) comes back exactly.  Vorbis and Opus are rounded to 24 bits,
+// far below the noise those codecs leave behind.  Unpacking is much cheaper than decoding.
+
+enum {
+	PACK_GROUP		= 32,
+	PACK_MAX_LEVEL	= (1 << 27) // sample values past this (16.0 at 24 bits) don't get packed
+};
+
+
+static inline unsigned int
+zigzag(int n)
+{
+	return (n << 1) ^ (n >> 31);
+}
+
+
+static inline int
+unzigzag(unsigned int n)
+{
+	return (n >> 1) ^ -(int)(n & 1);
+}
+
+
+// See if these samples are all integers divided by 2^(bits - 1), as FLAC gives us
+static bool
+exactly_int(const float *samples, long count, int bits)
+{
+	const float scale = (float)(1L << (bits - 1));
+	
+	for(long i=0; i < count; i++)
+	{
+		const float val = samples[i] * scale;
+		
+		// range first, converting NaN or something huge to int is undefined
+		if( !(val >= -scale && val <= scale) || val != (float)(int)val )
+			return false;
+	}
+	
+	return true;
+}
+
+
+static unsigned char *
+pack_block(const float *data, int channels, long samples, size_t *packed_size)
+{
+	const long total = channels * samples;
+	
+	const int bits = (exactly_int(data, total, 16) ? 16 : 24);
+	
+	const float scale = (float)(1L << (bits - 1));
+	
+	std::vector<int> ints(total);
+	
+	for(long i=0; i < total; i++)
+	{
+		const float val = data[i] * scale;
+		
+		if( !(val < PACK_MAX_LEVEL && val > -PACK_MAX_LEVEL) ) // also catches NaN
+			return NULL;
+		
+		ints[i] = (val >= 0 ? (int)(val + 0.5f) : (int)(val - 0.5f));
+	}
+	
+	
+	// worst case is every group at full width
+	const long groups_per_channel = (samples + PACK_GROUP - 1) / PACK_GROUP;
+	
+	std::vector<unsigned char> out(1 + (channels * groups_per_channel * (1 + PACK_GROUP * 4)));
+	
+	size_t pos = 0;
+	
+	out[pos++] = bits;
+	
+	for(int c=0; c < channels; c++)
+	{
+		const int *in = &ints[c * samples];
+		
+		int prev1 = 0, prev2 = 0;
+		
+		for(long g=0; g < samples; g += PACK_GROUP)
+		{
+			const long count = (samples - g < PACK_GROUP ? samples - g : (long)PACK_GROUP);
+			
+			unsigned int residuals[PACK_GROUP];
+			unsigned int all_bits = 0;
+			
+			for(long i=0; i < count; i++)
+			{
+				const int val = in[g + i];
+				
+				residuals[i] = zigzag(val - (2 * prev1) + prev2);
+				
+				all_bits |= residuals[i];
+				
+				prev2 = prev1;
+				prev1 = val;
+			}
+			
+			int width = 0;
+			
+			while(width < 32 && (all_bits >> width) != 0)
+				width++;
+			
+			out[pos++] = width;
+			
+			ogg_uint64_t accum = 0;
+			int accum_bits = 0;
+			
+			for(long i=0; i < count; i++)
+			{
+				accum |= (ogg_uint64_t)residuals[i] << accum_bits;
+				accum_bits += width;
+				
+				while(accum_bits >= 8)
+				{
+					out[pos++] = (accum & 0xff);
+					accum >>= 8;
+					accum_bits -= 8;
+				}
+			}
+			
+			if(accum_bits > 0)
+				out[pos++] = (accum & 0xff);
+		}
+	}
+	
+	unsigned char *packed = (unsigned char *)malloc(pos);
+	
+	if(packed != NULL)
+	{
+		memcpy(packed, &out[0], pos);
+		
+		*packed_size = pos;
+	}
+	
+	return packed;
+}
+
+
+// One group's residuals, which take up (count * width + 7) / 8 bytes
+static void
+unpack_group(const unsigned char *in, int width, long count, int *out)
+{
+	if(width == 0)
+	{
+		for(long i=0; i < count; i++)
+			out[i] = 0;
+	}
+	else if(width == 8)
+	{
+		for(long i=0; i < count; i++)
+			out[i] = unzigzag(in[i]);
+	}
+	else if(width == 16)
+	{
+		for(long i=0; i < count; i++)
+			out[i] = unzigzag(in[2 * i] | (in[(2 * i) + 1] << 8));
+	}
+	else
+	{
+		const size_t bytes = ((count * width) + 7) / 8;
+		
+		const ogg_uint64_t mask = (width == 32 ? 0xffffffffULL : ((1ULL << width) - 1));
+		
+		ogg_uint64_t accum = 0;
+		int accum_bits = 0;
+		size_t pos = 0;
+		
+		for(long i=0; i < count; i++)
+		{
+			// four bytes at a time while the group has them, accum_bits stays under 64
+			while(accum_bits < width)
+			{
+				if(pos + 4 <= bytes)
+				{
+					const ogg_uint64_t word = (ogg_uint64_t)in[pos] | ((ogg_uint64_t)in[pos + 1] << 8) |
+												((ogg_uint64_t)in[pos + 2] << 16) | ((ogg_uint64_t)in[pos + 3] << 24);
+					
+					accum |= word << accum_bits;
+					accum_bits += 32;
+					pos += 4;
+				}
+				else
+				{
+					accum |= (ogg_uint64_t)in[pos++] << accum_bits;
+					accum_bits += 8;
+				}
+			}
+			
+			out[i] = unzigzag(accum & mask);
+			
+			accum >>= width;
+			accum_bits -= width;
+		}
+	}
+}
+
+
+static void
+unpack_block(const unsigned char *packed, float *data, int channels, long samples)
+{
+	size_t pos = 0;
+	
+	const int bits = packed[pos++];
+	
+	const float scale = 1.0f / (float)(1L << (bits - 1));
+	
+	std::vector<int> ints(samples);
+	
+	for(int c=0; c < channels; c++)
+	{
+		// val = residual + 2 * prev1 - prev2 is the same as adding the residual
+		// to the slope and the slope to the last value, which is just two sums
+		int prev = 0, slope = 0;
+		
+		for(long g=0; g < samples; g += PACK_GROUP)
+		{
+			const long count = (samples - g < PACK_GROUP ? samples - g : (long)PACK_GROUP);
+			
+			const int width = packed[pos++];
+			
+			int *out = &ints[g];
+			
+			unpack_group(&packed[pos], width, count, out);
+			
+			pos += ((count * width) + 7) / 8;
+			
+			for(long i=0; i < count; i++)
+			{
+				slope += out[i];
+				prev += slope;
+				
+				out[i] = prev;
+			}
+		}
+		
+		int_to_float(&ints[0], data + (c * samples), samples, scale);
+	}
+}
+
+
+PackedAudioCache::PackedAudioCache(size_t max_bytes) :
+	_bytes(0),
+	_max_bytes(max_bytes),
+	_hits(0)
+{
+
+}
+
+
+PackedAudioCache::~PackedAudioCache()
+{
+	for(EntryMap::iterator i = _entries.begin(); i != _entries.end(); ++i)
+		free(i->second.data);
+}
+
+
+void
+PackedAudioCache::store(const FileIdentity &file, ogg_int64_t index, const float *data, int channels, long samples)
+{
+	if( !enabled() )
+		return;
+	
+	size_t packed_size = 0;
+	
+	unsigned char *packed = pack_block(data, channels, samples, &packed_size);
+	
+	if(packed == NULL)
+		return;
+	
+	ScopedLock lock(_mutex);
+	
+	Key key = { file, index };
+	
+	if(packed_size > _max_bytes || _entries.find(key) != _entries.end())
+	{
+		free(packed);
+		
+		return;
+	}
+	
+	while(!_lru.empty() && (_bytes + packed_size) > _max_bytes)
+		remove( _entries.find( _lru.back() ) );
+	
+	_lru.push_front(key);
+	
+	Entry &entry = _entries[key];
+	
+	entry.data = packed;
+	entry.size = packed_size;
+	entry.channels = channels;
+	entry.samples = samples;
+	entry.lru = _lru.begin();
+	
+	_bytes += packed_size;
+}
+
+
+bool
+PackedAudioCache::contains(const FileIdentity &file, ogg_int64_t index, int channels)
+{
+	if( !enabled() )
+		return false;
+	
+	ScopedLock lock(_mutex);
+	
+	Key key = { file, index };
+	
+	EntryMap::const_iterator i = _entries.find(key);
+	
+	return (i != _entries.end() && i->second.channels == channels);
+}
+
+
+bool
+PackedAudioCache::take(const FileIdentity &file, ogg_int64_t index, int channels, float **data, long *samples)
+{
+	if( !enabled() )
+		return false;
+	
+	unsigned char *packed = NULL;
+	long packed_samples = 0;
+	
+	{
+		ScopedLock lock(_mutex);
+		
+		Key key = { file, index };
+		
+		EntryMap::iterator i = _entries.find(key);
+		
+		if(i == _entries.end() || i->second.channels != channels)
+			return false;
+		
+		// the packed data is ours now, so remove() mustn't free it
+		packed = i->second.data;
+		packed_samples = i->second.samples;
+		
+		i->second.data = NULL;
+		
+		remove(i);
+		
+		_hits++;
+	}
+	
+	// like packing in store(), unpacking doesn't hold up the other threads
+	float *block = (float *)malloc(sizeof(float) * channels * packed_samples);
+	
+	if(block != NULL)
+	{
+		unpack_block(packed, block, channels, packed_samples);
+		
+		*data = block;
+		*samples = packed_samples;
+	}
+	
+	free(packed);
+	
+	return (block != NULL);
+}
+
+
+void
+PackedAudioCache::remove(EntryMap::iterator i)
+{
+	assert(i != _entries.end());
+	
+	_bytes -= i->second.size;
+	
+	free(i->second.data);
+	
+	_lru.erase(i->second.lru);
+	
+	_entries.erase(i);
+}
+
+
+void
+PackedAudioCache::get_stats(size_t *bytes, unsigned int *hits)
+{
+	ScopedLock lock(_mutex);
+	
+	*bytes = _bytes;
+	*hits = _hits;
+}
+
+
+AudioCache::AudioCache(size_t max_bytes, size_t max_packed_bytes) :
+	_bytes(0),
+	_max_bytes(max_bytes),
+	_hits(0),
+	_misses(0),
+	_packed(max_bytes > 0 ? max_packed_bytes : 0)
+{
+
+}
+
+
+AudioCache::~AudioCache()
+{
+	for(EntryMap::iterator i = _entries.begin(); i != _entries.end(); ++i)
+		free(i->second.data);
+}
+
+
+bool
+AudioCache::contains(const FileIdentity &file, ogg_int64_t index, int channels)
+{
+	{
+		ScopedLock lock(_mutex);
+		
+		Key key = { file, index };
+		
+		EntryMap::const_iterator i = _entries.find(key);
+		
+		if(i != _entries.end() && i->second.channels == channels)
+			return true;
+	}
+	
+	return _packed.contains(file, index, channels);
+}
+
+
+bool
+AudioCache::read(const FileIdentity &file, ogg_int64_t index, int channels,
+					long offset, long count, float **buffers, long *block_samples)
+{
+	Key key = { file, index };
+	
+	float *data = NULL;
+	long samples = 0;
+	
+	{
+		ScopedLock lock(_mutex);
+		
+		EntryMap::iterator i = _entries.find(key);
+		
+		if(i != _entries.end() && i->second.channels == channels)
+		{
+			_hits++;
+			
+			Entry &entry = i->second;
+			
+			_lru.splice(_lru.begin(), _lru, entry.lru);
+			
+			copy_block(entry.data, entry.samples, channels, offset, count, buffers);
+			
+			*block_samples = entry.samples;
+			
+			return true;
+		}
+	}
+	
+	// maybe it got packed, in which case it goes back up to the top tier
+	if( _packed.take(file, index, channels, &data, &samples) )
+	{
+		copy_block(data, samples, channels, offset, count, buffers);
+		
+		*block_samples = samples;
+		
+		insert(key, data, channels, samples);
+		
+		return true;
+	}
+	
+	ScopedLock lock(_mutex);
+	
+	_misses++;
+	
+	return false;
+}
+
+
+void
+AudioCache::copy_block(const float *data, long samples, int channels,
+						long offset, long count, float **buffers)
+{
+	if(offset < samples)
+	{
+		if(count > samples - offset)
+			count = samples - offset;
+		
+		for(int c=0; c < channels; c++)
+		{
+			memcpy(buffers[c], data + (c * samples) + offset, count * sizeof(float));
+		}
+	}
+}
+
+
+void
+AudioCache::store(const FileIdentity &file, ogg_int64_t index, int channels,
+					float * const *buffers, long samples)
+{
+	const size_t bytes = sizeof(float) * channels * samples;
+	
+	if(samples <= 0 || bytes > _max_bytes)
+		return;
+	
+	float *data = (float *)malloc(bytes);
+	
+	if(data == NULL)
+		return;
+	
+	for(int c=0; c < channels; c++)
+	{
+		memcpy(data + (c * samples), buffers[c], samples * sizeof(float));
+	}
+	
+	Key key = { file, index };
+	
+	insert(key, data, channels, samples);
+}
+
+
+void
+AudioCache::insert(const Key &key, float *data, int channels, long samples)
+{
+	const size_t bytes = sizeof(float) * channels * samples;
+	
+	EvictedList evicted;
+	
+	{
+		ScopedLock lock(_mutex);
+		
+		if(bytes > _max_bytes || _entries.find(key) != _entries.end())
+		{
+			free(data); // somebody else beat us to it
+			
+			return;
+		}
+		
+		evict(bytes, evicted);
+		
+		_lru.push_front(key);
+		
+		Entry &entry = _entries[key];
+		
+		entry.data = data;
+		entry.channels = channels;
+		entry.samples = samples;
+		entry.lru = _lru.begin();
+		
+		_bytes += bytes;
+	}
+	
+	// packing takes a while, so not while holding the lock
+	pack(evicted);
+}
+
+
+void
+AudioCache::evict(size_t bytes_needed, EvictedList &evicted)
+{
+	while(!_lru.empty() && (_bytes + bytes_needed) > _max_bytes)
+	{
+		EntryMap::iterator i = _entries.find( _lru.back() );
+		
+		assert(i != _entries.end());
+		
+		_bytes -= sizeof(float) * i->second.channels * i->second.samples;
+		
+		Evicted victim = { i->first, i->second.data, i->second.channels, i->second.samples };
+		
+		evicted.push_back(victim);
+		
+		_entries.erase(i);
+		
+		_lru.pop_back();
+	}
+}
+
+
+void
+AudioCache::pack(EvictedList &evicted)
+{
+	for(EvictedList::iterator i = evicted.begin(); i != evicted.end(); ++i)
+	{
+		_packed.store(i->key.file, i->key.index, i->data, i->channels, i->samples);
+		
+		free(i->data);
+	}
+}
+
+
+void
+AudioCache::get_stats(size_t *bytes, size_t *packed_bytes, unsigned int *hits, unsigned int *misses)
+{
+	unsigned int packed_hits = 0;
+	
+	_packed.get_stats(packed_bytes, &packed_hits);
+	
+	ScopedLock lock(_mutex);
+	
+	*bytes = _bytes;
+	*hits = _hits + packed_hits;
+	*misses = _misses;
+}
+
+
+AudioCache g_audio_cache( (size_t)get_setting(SETTING_CACHE_MB, 256) * 1024 * 1024,
+								(size_t)get_setting(SETTING_PACKED_CACHE_MB, 256) * 1024 * 1024 );
+
+
+#pragma mark-
+
+
+// The disk cache
+//
+// Optionally, a clip can be decoded once in the background into a file of plain floats,
+// already in Premiere's channel order, which we then memory-map and copy from.  After that
+// a Vorbis or Opus clip scrubs like a WAV.  The files are named after the clip's identity,
+// so they go stale by themselves when the clip changes, and the oldest ones get deleted
+// when the folder goes over its size limit.
+
+ogg_int64_t
+disk_cache_limit()
+{
+	return (ogg_int64_t)get_setting(SETTING_DISK_CACHE_MB, 0) * 1024 * 1024;
+}
+
+
+static bool
+is_directory(const PathString &path)
+{
+#ifdef PRWIN_ENV
+	DWORD attributes = GetFileAttributesW(path.c_str());
+	
+	return (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY));
+#else
+	struct stat st;
+	
+	return (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+#endif
+}
+
+
+// makes any missing parent folders too
+static bool
+make_directory(const PathString &path)
+{
+	for(size_t i = 1; i <= path.size(); i++)
+	{
+		if(i == path.size() || path[i] == PATH_SEPARATOR || path[i] == '/')
+		{
+			const PathString parent = path.substr(0, i);
+			
+		#ifdef PRWIN_ENV
+			CreateDirectoryW(parent.c_str(), NULL);
+		#else
+			mkdir(parent.c_str(), 0755);
+		#endif
+		}
+	}
+	
+	return is_directory(path);
+}
+
+
+// the last folder disk_cache_dir() made sure of, so every cache lookup isn't a trip to the disk
+static Mutex g_cache_dir_mutex;
+static PathString g_cache_dir_made;
+
+
+// empty if we don't have one
+PathString
+disk_cache_dir()
+{
+	PathString dir;
+	
+	if( !get_env_path(SETTING_CACHE_DIR, dir) )
+	{
+	#ifdef PRWIN_ENV
+		if( get_env_path("LOCALAPPDATA", dir) )
+			dir += L"\\OggImport";
+	#elif defined(PRMAC_ENV)
+		if( get_env_path("HOME", dir) )
+			dir += "/Library/Caches/com.fnordware.OggImport";
+	#else
+		if( get_env_path("XDG_CACHE_HOME", dir) )
+			dir += "/OggImport";
+		else if( get_env_path("HOME", dir) )
+			dir += "/.cache/OggImport";
+	#endif
+	}
+	
+	if( !dir.empty() )
+	{
+		ScopedLock lock(g_cache_dir_mutex);
+		
+		if(dir != g_cache_dir_made)
+		{
+			if( make_directory(dir) )
+				g_cache_dir_made = dir;
+			else
+				dir.clear();
+		}
+	}
+	
+	return dir;
+}
+
+
+PathString
+disk_cache_path(const PathString &dir, const FileIdentity &identity, const char *extension)
+{
+	char name[128];
+	
+	sprintf(name, "%016llx-%llx-%llx.%s",
+			(unsigned long long)identity.path_hash,
+			(unsigned long long)identity.size,
+			(unsigned long long)identity.modified,
+			extension);
+	
+	return dir + PATH_SEPARATOR + PathString(name, name + strlen(name));
+}
+
+
+FILE *
+fopen_path(const PathString &path, const char *mode)
+{
+#ifdef PRWIN_ENV
+	const std::wstring wide_mode(mode, mode + strlen(mode));
+	
+	return _wfopen(path.c_str(), wide_mode.c_str());
+#else
+	return fopen(path.c_str(), mode);
+#endif
+}
+
+
+bool
+rename_file(const PathString &from, const PathString &to)
+{
+#ifdef PRWIN_ENV
+	return MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+	return (rename(from.c_str(), to.c_str()) == 0);
+#endif
+}
+
+
+void
+delete_file(const PathString &path)
+{
+#ifdef PRWIN_ENV
+	DeleteFileW(path.c_str());
+#else
+	unlink(path.c_str());
+#endif
+}
+
+
+// mark a cache file as recently used
+void
+touch_file(const PathString &path)
+{
+#ifdef PRWIN_ENV
+	HANDLE fileH = CreateFileW(path.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+								NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	
+	if(fileH != INVALID_HANDLE_VALUE)
+	{
+		FILETIME now;
+		
+		GetSystemTimeAsFileTime(&now);
+		
+		SetFileTime(fileH, NULL, NULL, &now);
+		
+		CloseHandle(fileH);
+	}
+#else
+	utime(path.c_str(), NULL);
+#endif
+}
+
+
+typedef struct {
+	PathString	path;
+	ogg_int64_t	size;
+} CacheFile;
+
+
+// delete the least recently used files until we're under the limit
+void
+trim_disk_cache(const PathString &dir, ogg_int64_t max_bytes)
+{
+	std::multimap<ogg_int64_t, CacheFile> files; // by modification time
+	
+	ogg_int64_t total = 0;
+	
+#ifdef PRWIN_ENV
+	WIN32_FIND_DATAW find_data;
+	
+	HANDLE findH = FindFirstFileW((dir + L"\\*").c_str(), &find_data);
+	
+	if(findH != INVALID_HANDLE_VALUE)
+	{
+		do{
+			const PathString name = find_data.cFileName;
+			
+			if( !(find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+				!(name.size() > 4 && name.substr(name.size() - 4) == L".tmp") ) // still being written
+			{
+				CacheFile file = { dir + PATH_SEPARATOR + name,
+									(ogg_int64_t)(((ogg_uint64_t)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow) };
+				
+				const ogg_int64_t modified = ((ogg_int64_t)find_data.ftLastWriteTime.dwHighDateTime << 32) |
+												find_data.ftLastWriteTime.dwLowDateTime;
+				
+				files.insert( std::make_pair(modified, file) );
+				
+				total += file.size;
+			}
+		}while( FindNextFileW(findH, &find_data) );
+		
+		FindClose(findH);
+	}
+#else
+	DIR *dirP = opendir(dir.c_str());
+	
+	if(dirP != NULL)
+	{
+		struct dirent *entry;
+		
+		while( (entry = readdir(dirP)) != NULL )
+		{
+			const PathString name = entry->d_name;
+			
+			const PathString path = dir + PATH_SEPARATOR + name;
+			
+			struct stat st;
+			
+			if(stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+				!(name.size() > 4 && name.substr(name.size() - 4) == ".tmp"))
+			{
+				CacheFile file = { path, st.st_size };
+				
+				files.insert( std::make_pair((ogg_int64_t)st.st_mtime, file) );
+				
+				total += file.size;
+			}
+		}
+		
+		closedir(dirP);
+	}
+#endif
+
+	for(std::multimap<ogg_int64_t, CacheFile>::iterator i = files.begin(); i != files.end() && total > max_bytes; ++i)
+	{
+		delete_file(i->second.path); // might fail if it's in use, oh well
+		
+		total -= i->second.size;
+	}
+}
+
+
+
+const char g_conformed_magic[8] = { 'O', 'g', 'g', 'P', 'C', 'M', '0', '1' };
+
+
+ConformedAudio *
+ConformedAudio::open(const PathString &path, const FileIdentity &identity, int channels)
+{
+	MemorySource *source = MemorySource::map(path);
+	
+	if(source == NULL)
+		return NULL;
+	
+	ConformedHeader header;
+	
+	const bool valid = source->read(0, &header, sizeof(header)) == sizeof(header) &&
+						memcmp(header.magic, g_conformed_magic, sizeof(header.magic)) == 0 &&
+						header.identity == identity &&
+						header.channels == channels &&
+						header.block_samples > 0 &&
+						source->get_size() == (ogg_int64_t)sizeof(header) + (header.samples * channels * (ogg_int64_t)sizeof(float));
+	
+	if(!valid)
+	{
+		delete source;
+		
+		return NULL;
+	}
+	
+	touch_file(path);
+	
+	return new ConformedAudio(source, header);
+}
+
+
+long
+ConformedAudio::read(ogg_int64_t position, long size, float **buffers) const
+{
+	const ogg_int64_t block_samples = _header.block_samples;
+	
+	const float *data = reinterpret_cast<const float *>(_source->get_data() + sizeof(ConformedHeader));
+	
+	long pos = 0;
+	
+	while(pos < size && position + pos < _header.samples)
+	{
+		const ogg_int64_t sample = position + pos;
+		
+		const ogg_int64_t block_start = (sample / block_samples) * block_samples;
+		
+		const long block_length = (_header.samples - block_start < block_samples ? _header.samples - block_start : block_samples);
+		
+		const long offset = (sample - block_start);
+		
+		long count = size - pos;
+		
+		if(count > block_length - offset)
+			count = block_length - offset;
+		
+		const float *block = data + (block_start * _header.channels);
+		
+		for(int c=0; c < _header.channels; c++)
+		{
+			memcpy(buffers[c] + pos, block + (c * block_length) + offset, count * sizeof(float));
+		}
+		
+		pos += count;
+	}
+	
+	return pos;
+}
+
+
+#pragma mark-
+
+
+// A clip's ClipInfo, as it's kept in the disk cache folder
+typedef struct
+{
+	char			magic[8];
+	FileIdentity	identity;
+	csSDK_int32		file_type;
+	ogg_int32_t		channels;
+	ogg_int32_t		sample_rate;
+	ogg_int32_t		bits_per_sample;
+	ogg_int64_t		duration;
+} ClipInfoHeader;
+
+// 1 had only the first link's duration, 2 followed the header with each link's length,
+// which nothing read back.  The decoder works out the links when it opens anyway.
+static const char g_info_magic[8] = { 'O', 'g', 'g', 'I', 'n', 'f', 'o', '3' };
+
+
+bool
+read_clip_info(const FileIdentity &identity, csSDK_int32 fileType, ClipInfo *info)
+{
+	if(!get_setting(SETTING_INFO_CACHE, 1) || identity.size <= 0)
+		return false;
+	
+	const PathString dir = disk_cache_dir();
+	
+	if( dir.empty() )
+		return false;
+	
+	FILE *f = fopen_path(disk_cache_path(dir, identity, "info"), "rb");
+	
+	if(f == NULL)
+		return false;
+	
+	ClipInfoHeader header;
+	
+	bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+				memcmp(header.magic, g_info_magic, sizeof(header.magic)) == 0 &&
+				header.identity == identity &&
+				header.file_type == fileType &&
+				header.channels > 0 &&
+				header.sample_rate > 0 &&
+				fgetc(f) == EOF;
+	
+	fclose(f);
+	
+	if(ok)
+	{
+		info->channels = header.channels;
+		info->sampleRate = header.sample_rate;
+		info->bitsPerSample = header.bits_per_sample;
+		info->duration = header.duration;
+	}
+	
+	return ok;
+}
+
+
+void
+write_clip_info(const FileIdentity &identity, csSDK_int32 fileType, const ClipInfo &info)
+{
+	if(!get_setting(SETTING_INFO_CACHE, 1) || identity.size <= 0)
+		return;
+	
+	const PathString dir = disk_cache_dir();
+	
+	if( dir.empty() )
+		return;
+	
+	ClipInfoHeader header;
+	
+	memset(&header, 0, sizeof(header));
+	
+	memcpy(header.magic, g_info_magic, sizeof(header.magic));
+	header.identity = identity;
+	header.file_type = fileType;
+	header.channels = info.channels;
+	header.sample_rate = info.sampleRate;
+	header.bits_per_sample = info.bitsPerSample;
+	header.duration = info.duration;
+	
+	// If another instance is writing the same file, it's writing the same bytes,
+	// and a short file won't pass the check in read_clip_info().
+	const PathString path = disk_cache_path(dir, identity, "info");
+	
+	FILE *f = fopen_path(path, "wb");
+	
+	if(f != NULL)
+	{
+		bool ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+		
+		if(fclose(f) != 0 || !ok)
+			delete_file(path);
+	}
+}
@@ -0,0 +1,270 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Brendan Bolles
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// *	   Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// *	   Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+
+// ------------------------------------------------------------------------
+//
+// Decoded audio caches for the Ogg importer, in memory and on disk
+//
+// by Brendan Bolles <brendan@fnordware.com>
+//
+// ------------------------------------------------------------------------
+
+
+#ifndef OGG_PREMIERE_CACHE_H
+#define OGG_PREMIERE_CACHE_H
+
+#include "Ogg_Premiere_Platform.h"
+
+#include <stdio.h>
+
+#include <map>
+#include <list>
+
+
+// The second tier of the audio cache, holding packed blocks
+class PackedAudioCache
+{
+  public:
+	PackedAudioCache(size_t max_bytes);
+	~PackedAudioCache();
+	
+	bool enabled() const { return (_max_bytes > 0); }
+	
+	// packs the block, data stays with the caller
+	void store(const FileIdentity &file, ogg_int64_t index, const float *data, int channels, long samples);
+	
+	// unpacks into a newly malloc'ed block, which is taken out of here
+	bool take(const FileIdentity &file, ogg_int64_t index, int channels, float **data, long *samples);
+	
+	bool contains(const FileIdentity &file, ogg_int64_t index, int channels);
+	
+	void get_stats(size_t *bytes, unsigned int *hits);
+	
+  private:
+	typedef struct Key {
+		FileIdentity	file;
+		ogg_int64_t		index;
+		
+		bool operator < (const struct Key &other) const {
+			return (file == other.file ? index < other.index : file < other.file);
+		}
+	} Key;
+	
+	typedef std::list<Key> LRUList;
+	
+	typedef struct {
+		unsigned char		*data;
+		size_t				size;
+		int					channels;
+		long				samples;
+		LRUList::iterator	lru;
+	} Entry;
+	
+	typedef std::map<Key, Entry> EntryMap;
+	
+	void remove(EntryMap::iterator i);
+	
+	Mutex _mutex;
+	
+	EntryMap _entries;
+	LRUList _lru;
+	
+	size_t _bytes;
+	const size_t _max_bytes;
+	
+	unsigned int _hits;
+};
+
+
+// Decoded audio, already in Premiere's channel order.  Premiere asks for the same
+// stretches of audio over and over (looping, waveform drawing, shuttling back and forth),
+// so we hold on to recent blocks instead of seeking and decoding every time.
+// There's one cache for the whole process with a single memory budget, shared by every
+// clip.  Blocks are filed by file identity, so two importer instances with the same file
+// open use the same blocks.
+class AudioCache
+{
+  public:
+	enum { BLOCK_SAMPLES = 4096 };
+	
+	AudioCache(size_t max_bytes, size_t max_packed_bytes);
+	~AudioCache();
+	
+	bool enabled() const { return (_max_bytes > 0); }
+	
+	// Copy count samples, starting at offset into the block, into buffers.  Returns false if
+	// the block isn't here.  Otherwise *block_samples tells how long the block is, which is
+	// less than BLOCK_SAMPLES at the end of the file, and count gets cut down to fit.
+	bool read(const FileIdentity &file, ogg_int64_t index, int channels,
+				long offset, long count, float **buffers, long *block_samples);
+	
+	void store(const FileIdentity &file, ogg_int64_t index, int channels,
+				float * const *buffers, long samples);
+	
+	// in either tier, doesn't count as a hit or miss
+	bool contains(const FileIdentity &file, ogg_int64_t index, int channels);
+	
+	void get_stats(size_t *bytes, size_t *packed_bytes, unsigned int *hits, unsigned int *misses);
+	
+  private:
+	typedef struct Key {
+		FileIdentity	file;
+		ogg_int64_t		index;
+		
+		bool operator < (const struct Key &other) const {
+			return (file == other.file ? index < other.index : file < other.file);
+		}
+	} Key;
+	
+	typedef std::list<Key> LRUList; // most recently used at the front
+	
+	typedef struct {
+		float				*data;	// channel after channel, samples each
+		int					channels;
+		long				samples;
+		LRUList::iterator	lru;
+	} Entry;
+	
+	typedef std::map<Key, Entry> EntryMap;
+	
+	typedef struct {
+		Key		key;
+		float	*data;
+		int		channels;
+		long	samples;
+	} Evicted;
+	
+	typedef std::vector<Evicted> EvictedList;
+	
+	static void copy_block(const float *data, long samples, int channels,
+							long offset, long count, float **buffers);
+	
+	// takes ownership of data
+	void insert(const Key &key, float *data, int channels, long samples);
+	
+	void evict(size_t bytes_needed, EvictedList &evicted);
+	
+	void pack(EvictedList &evicted);
+	
+	Mutex _mutex;
+	
+	EntryMap _entries;
+	LRUList _lru;
+	
+	size_t _bytes;
+	const size_t _max_bytes;
+	
+	unsigned int _hits;
+	unsigned int _misses;
+	
+	PackedAudioCache _packed;
+};
+
+
+// the one for the whole process
+extern AudioCache g_audio_cache;
+
+
+#pragma mark-
+
+
+// The disk cache folder, and the files in it
+
+ogg_int64_t disk_cache_limit(); // 0 if the disk cache is off
+
+PathString disk_cache_dir(); // empty if we don't have one
+
+PathString disk_cache_path(const PathString &dir, const FileIdentity &identity, const char *extension);
+
+FILE * fopen_path(const PathString &path, const char *mode);
+bool rename_file(const PathString &from, const PathString &to);
+void delete_file(const PathString &path);
+void touch_file(const PathString &path); // mark a cache file as recently used
+
+// delete the least recently used files until we're under the limit
+void trim_disk_cache(const PathString &dir, ogg_int64_t max_bytes);
+
+
+// What's at the start of a conformed audio file.  After it come blocks of
+// block_samples, one channel after another, with the last block being shorter.
+typedef struct
+{
+	char			magic[8];
+	FileIdentity	identity;
+	ogg_int64_t		samples;
+	ogg_int32_t		channels;
+	ogg_int32_t		block_samples;
+	ogg_int32_t		sample_rate;
+	ogg_int32_t		reserved[3];
+} ConformedHeader;
+
+extern const char g_conformed_magic[8];
+
+
+class ConformedAudio
+{
+  public:
+	static ConformedAudio * open(const PathString &path, const FileIdentity &identity, int channels);
+	
+	~ConformedAudio() { delete _source; }
+	
+	const FileIdentity & identity() const { return _header.identity; }
+	
+	// returns the number of samples copied, less than size at the end
+	long read(ogg_int64_t position, long size, float **buffers) const;
+	
+  private:
+	ConformedAudio(MemorySource *source, const ConformedHeader &header) : _source(source), _header(header) {}
+	
+	MemorySource *_source;
+	const ConformedHeader _header;
+};
+
+
+#pragma mark-
+
+
+// What imGetInfo8 needs to know.  We keep this in the disk cache folder too, so opening
+// a project doesn't mean parsing the headers of every clip in it all over again, which
+// takes a while over a network.
+typedef struct
+{
+	int				channels;
+	int				sampleRate;
+	int				bitsPerSample;	// 0 for Vorbis and Opus
+	ogg_int64_t		duration;
+} ClipInfo;
+
+
+bool read_clip_info(const FileIdentity &identity, csSDK_int32 fileType, ClipInfo *info);
+void write_clip_info(const FileIdentity &identity, csSDK_int32 fileType, const ClipInfo &info);
+
+
+#endif // OGG_PREMIERE_CACHE_H
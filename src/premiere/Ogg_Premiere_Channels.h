@@ -0,0 +1,515 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Brendan Bolles
+//
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// *	   Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// *	   Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+
+// ------------------------------------------------------------------------
+//
+// Channel order and sample conversion for the Ogg Premiere plug-ins
+//
+// by Brendan Bolles <brendan@fnordware.com>
+//
+// ------------------------------------------------------------------------
+
+
+// Channel orders, and the loops that move audio between them.  Shared by the importer
+// and the exporter.
+//
+// The channel order gets sorted out once per request by picking buffer pointers, so the
+// loops themselves just copy or convert.  The loops are templates on the channel count,
+// so mono, stereo and 5.1 each get their own, with the SIMD versions where they help.
+
+
+#ifndef OGG_PREMIERE_CHANNELS_H
+#define OGG_PREMIERE_CHANNELS_H
+
+#include <string.h>
+#include <math.h>
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OGG_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define OGG_NEON
+#include <arm_neon.h>
+#endif
+
+
+// for surround channels
+// Premiere uses Left, Right, Left Rear, Right Rear, Center, LFE
+// Ogg (and Opus) uses Left, Center, Right, Left Rear, Right Rear, LFE
+// http://www.xiph.org/vorbis/doc/Vorbis_I_spec.html#x1-800004.3.9
+// FLAC uses Left, Right, Center, LFE, Left Rear, Right Rear
+// http://xiph.org/flac/format.html#frame_header
+//
+// Premiere only takes mono, stereo and 5.1, but a link in a chained file can have
+// 3 to 5 channels.  Those get the 5.1 order with the missing channels left out:
+// L R C, L R Ls Rs, and L R Ls Rs C.
+typedef enum {
+	VORBIS_LAYOUT, // Opus too
+	FLAC_LAYOUT
+} ChannelLayout;
+
+
+// Which Premiere channel channel C is.  Mono and stereo are the same everywhere.
+template <ChannelLayout LAYOUT, int CHANNELS, int C>
+struct PremiereChannel { enum { value = C }; };
+
+template <int C>
+struct PremiereChannel<VORBIS_LAYOUT, 6, C> { enum { value = (C == 1 ? 4 : C == 2 ? 1 : C == 3 ? 2 : C == 4 ? 3 : C) }; };
+
+template <int C>
+struct PremiereChannel<FLAC_LAYOUT, 6, C> { enum { value = (C == 2 ? 4 : C == 3 ? 5 : C == 4 ? 2 : C == 5 ? 3 : C) }; };
+
+template <int C>
+struct PremiereChannel<VORBIS_LAYOUT, 5, C> { enum { value = (C == 1 ? 4 : C == 2 ? 1 : C == 3 ? 2 : C == 4 ? 3 : C) }; };
+
+template <int C>
+struct PremiereChannel<FLAC_LAYOUT, 5, C> { enum { value = (C == 2 ? 4 : C == 3 ? 2 : C == 4 ? 3 : C) }; };
+
+template <int C>
+struct PremiereChannel<VORBIS_LAYOUT, 3, C> { enum { value = (C == 1 ? 2 : C == 2 ? 1 : C) }; };
+
+
+// Unrolled pointer shuffling, one channel at a time from C on down
+template <ChannelLayout LAYOUT, int CHANNELS, int C = CHANNELS - 1>
+struct ChannelMapper
+{
+	template <typename T>
+	static void to_premiere(T * const *layout_order, T **premiere_order)
+	{
+		premiere_order[PremiereChannel<LAYOUT, CHANNELS, C>::value] = layout_order[C];
+		
+		ChannelMapper<LAYOUT, CHANNELS, C - 1>::to_premiere(layout_order, premiere_order);
+	}
+	
+	template <typename T>
+	static void to_layout(T * const *premiere_order, T **layout_order)
+	{
+		layout_order[C] = premiere_order[PremiereChannel<LAYOUT, CHANNELS, C>::value];
+		
+		ChannelMapper<LAYOUT, CHANNELS, C - 1>::to_layout(premiere_order, layout_order);
+	}
+};
+
+template <ChannelLayout LAYOUT, int CHANNELS>
+struct ChannelMapper<LAYOUT, CHANNELS, -1>
+{
+	template <typename T>
+	static void to_premiere(T * const *, T **) {}
+	
+	template <typename T>
+	static void to_layout(T * const *, T **) {}
+};
+
+
+// Buffers in the codec's order, put in Premiere's order.  Channel counts that
+// don't have a layout (or already match) keep the order they have.
+template <typename T>
+inline void
+to_premiere_order(ChannelLayout layout, int channels, T * const *layout_order, T **premiere_order)
+{
+	if(channels == 6 && layout == VORBIS_LAYOUT)
+		ChannelMapper<VORBIS_LAYOUT, 6>::to_premiere(layout_order, premiere_order);
+	else if(channels == 6 && layout == FLAC_LAYOUT)
+		ChannelMapper<FLAC_LAYOUT, 6>::to_premiere(layout_order, premiere_order);
+	else if(channels == 5 && layout == VORBIS_LAYOUT)
+		ChannelMapper<VORBIS_LAYOUT, 5>::to_premiere(layout_order, premiere_order);
+	else if(channels == 5 && layout == FLAC_LAYOUT)
+		ChannelMapper<FLAC_LAYOUT, 5>::to_premiere(layout_order, premiere_order);
+	else if(channels == 3 && layout == VORBIS_LAYOUT)
+		ChannelMapper<VORBIS_LAYOUT, 3>::to_premiere(layout_order, premiere_order);
+	else
+	{
+		for(int c=0; c < channels; c++)
+			premiere_order[c] = layout_order[c];
+	}
+}
+
+
+// ...and the other way
+template <typename T>
+inline void
+to_layout_order(ChannelLayout layout, int channels, T * const *premiere_order, T **layout_order)
+{
+	if(channels == 6 && layout == VORBIS_LAYOUT)
+		ChannelMapper<VORBIS_LAYOUT, 6>::to_layout(premiere_order, layout_order);
+	else if(channels == 6 && layout == FLAC_LAYOUT)
+		ChannelMapper<FLAC_LAYOUT, 6>::to_layout(premiere_order, layout_order);
+	else if(channels == 5 && layout == VORBIS_LAYOUT)
+		ChannelMapper<VORBIS_LAYOUT, 5>::to_layout(premiere_order, layout_order);
+	else if(channels == 5 && layout == FLAC_LAYOUT)
+		ChannelMapper<FLAC_LAYOUT, 5>::to_layout(premiere_order, layout_order);
+	else if(channels == 3 && layout == VORBIS_LAYOUT)
+		ChannelMapper<VORBIS_LAYOUT, 3>::to_layout(premiere_order, layout_order);
+	else
+	{
+		for(int c=0; c < channels; c++)
+			layout_order[c] = premiere_order[c];
+	}
+}
+
+
+// Interleaved to planar
+template <int CHANNELS>
+inline void
+deinterleave(const float *in, float * const *out, long samples)
+{
+	for(long i=0; i < samples; i++)
+	{
+		for(int c=0; c < CHANNELS; c++)
+			out[c][i] = in[(i * CHANNELS) + c];
+	}
+}
+
+template <>
+inline void
+deinterleave<1>(const float *in, float * const *out, long samples)
+{
+	memcpy(out[0], in, sizeof(float) * samples);
+}
+
+template <>
+inline void
+deinterleave<2>(const float *in, float * const *out, long samples)
+{
+	long i = 0;
+
+#if defined(OGG_SSE2)
+	for(; i + 4 <= samples; i += 4)
+	{
+		const __m128 a = _mm_loadu_ps(&in[i * 2]);		// L0 R0 L1 R1
+		const __m128 b = _mm_loadu_ps(&in[(i * 2) + 4]);	// L2 R2 L3 R3
+		
+		_mm_storeu_ps(&out[0][i], _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(&out[1][i], _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+#elif defined(OGG_NEON)
+	for(; i + 4 <= samples; i += 4)
+	{
+		const float32x4x2_t v = vld2q_f32(&in[i * 2]);
+		
+		vst1q_f32(&out[0][i], v.val[0]);
+		vst1q_f32(&out[1][i], v.val[1]);
+	}
+#endif
+
+	for(; i < samples; i++)
+	{
+		out[0][i] = in[(i * 2) + 0];
+		out[1][i] = in[(i * 2) + 1];
+	}
+}
+
+template <>
+inline void
+deinterleave<6>(const float *in, float * const *out, long samples)
+{
+	long i = 0;
+
+#if defined(OGG_SSE2)
+	for(; i + 4 <= samples; i += 4)
+	{
+		const float *s = &in[i * 6];
+		
+		// channels 0-3 of four samples, then 2-5, turned on their sides
+		__m128 r0 = _mm_loadu_ps(s);
+		__m128 r1 = _mm_loadu_ps(s + 6);
+		__m128 r2 = _mm_loadu_ps(s + 12);
+		__m128 r3 = _mm_loadu_ps(s + 18);
+		
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		
+		__m128 q0 = _mm_loadu_ps(s + 2);
+		__m128 q1 = _mm_loadu_ps(s + 8);
+		__m128 q2 = _mm_loadu_ps(s + 14);
+		__m128 q3 = _mm_loadu_ps(s + 20);
+		
+		_MM_TRANSPOSE4_PS(q0, q1, q2, q3);
+		
+		_mm_storeu_ps(&out[0][i], r0);
+		_mm_storeu_ps(&out[1][i], r1);
+		_mm_storeu_ps(&out[2][i], r2);
+		_mm_storeu_ps(&out[3][i], r3);
+		_mm_storeu_ps(&out[4][i], q2);
+		_mm_storeu_ps(&out[5][i], q3);
+	}
+#elif defined(OGG_NEON)
+	for(; i + 4 <= samples; i += 4)
+	{
+		// two samples at a time come out as {c0 c3 c0 c3} {c1 c4 c1 c4} {c2 c5 c2 c5}
+		const float32x4x3_t a = vld3q_f32(&in[i * 6]);
+		const float32x4x3_t b = vld3q_f32(&in[(i * 6) + 12]);
+		
+		for(int k=0; k < 3; k++)
+		{
+			const float32x4x2_t v = vuzpq_f32(a.val[k], b.val[k]);
+			
+			vst1q_f32(&out[k][i], v.val[0]);
+			vst1q_f32(&out[k + 3][i], v.val[1]);
+		}
+	}
+#endif
+
+	for(; i < samples; i++)
+	{
+		for(int c=0; c < 6; c++)
+			out[c][i] = in[(i * 6) + c];
+	}
+}
+
+inline void
+deinterleave(int channels, const float *in, float * const *out, long samples)
+{
+	switch(channels)
+	{
+		case 1:		deinterleave<1>(in, out, samples);	break;
+		case 2:		deinterleave<2>(in, out, samples);	break;
+		case 6:		deinterleave<6>(in, out, samples);	break;
+		
+		default:
+			for(int c=0; c < channels; c++)
+			{
+				for(long i=0; i < samples; i++)
+					out[c][i] = in[(i * channels) + c];
+			}
+		break;
+	}
+}
+
+
+// Audio with a different number of channels than the clip, like from one link of a
+// chained Ogg file.  Both sides are in Premiere's order, so 5.1 is L, R, Ls, Rs, C, LFE.
+// Going down, the surrounds and center get folded in at -3 dB, and the LFE is dropped.
+// Going up, mono goes to the center (or both sides for stereo), and stereo goes left and
+// right.  3 to 5 channels are a 5.1 with some missing, which get silence.
+inline void
+convert_channels(const float * const *in, int in_channels, float * const *out, int out_channels, long samples)
+{
+	const float minus_3dB = 0.70710678f;
+	
+	if(in_channels >= 3 && in_channels <= 5 && (out_channels == 6 || out_channels <= 2))
+	{
+		// only 3 channels leaves a gap: L R C goes to L R - - C
+		const float *surround[6] = { NULL, NULL, NULL, NULL, NULL, NULL };
+		
+		for(int c=0; c < in_channels; c++)
+			surround[(in_channels == 3 && c == 2) ? 4 : c] = in[c];
+		
+		if(out_channels == 6)
+		{
+			for(int c=0; c < 6; c++)
+			{
+				if(surround[c] != NULL)
+					memcpy(out[c], surround[c], sizeof(float) * samples);
+				else
+					memset(out[c], 0, sizeof(float) * samples);
+			}
+		}
+		else
+		{
+			#define OGG_SURROUND(C, I)	(surround[C] != NULL ? surround[C][I] : 0.f)
+			
+			for(long i=0; i < samples; i++)
+			{
+				const float left = OGG_SURROUND(0, i) + (minus_3dB * (OGG_SURROUND(4, i) + OGG_SURROUND(2, i)));
+				const float right = OGG_SURROUND(1, i) + (minus_3dB * (OGG_SURROUND(4, i) + OGG_SURROUND(3, i)));
+				
+				if(out_channels == 2)
+				{
+					out[0][i] = left;
+					out[1][i] = right;
+				}
+				else
+					out[0][i] = 0.5f * (left + right);
+			}
+			
+			#undef OGG_SURROUND
+		}
+	}
+	else if(in_channels == 6 && out_channels <= 2)
+	{
+		for(long i=0; i < samples; i++)
+		{
+			const float left = in[0][i] + (minus_3dB * (in[4][i] + in[2][i]));
+			const float right = in[1][i] + (minus_3dB * (in[4][i] + in[3][i]));
+			
+			if(out_channels == 2)
+			{
+				out[0][i] = left;
+				out[1][i] = right;
+			}
+			else
+				out[0][i] = 0.5f * (left + right);
+		}
+	}
+	else if(in_channels == 2 && out_channels == 1)
+	{
+		for(long i=0; i < samples; i++)
+			out[0][i] = 0.5f * (in[0][i] + in[1][i]);
+	}
+	else if(in_channels == 1 && out_channels == 2)
+	{
+		memcpy(out[0], in[0], sizeof(float) * samples);
+		memcpy(out[1], in[0], sizeof(float) * samples);
+	}
+	else
+	{
+		const int center = (in_channels == 1 && out_channels == 6 ? 4 : -1);
+		
+		for(int c=0; c < out_channels; c++)
+		{
+			if(c == center)
+				memcpy(out[c], in[0], sizeof(float) * samples);
+			else if(c < in_channels && center < 0)
+				memcpy(out[c], in[c], sizeof(float) * samples);
+			else
+				memset(out[c], 0, sizeof(float) * samples);
+		}
+	}
+}
+
+
+// Planar to interleaved
+template <int CHANNELS>
+inline void
+interleave(const float * const *in, float *out, long samples)
+{
+	for(long i=0; i < samples; i++)
+	{
+		for(int c=0; c < CHANNELS; c++)
+			out[(i * CHANNELS) + c] = in[c][i];
+	}
+}
+
+template <>
+inline void
+interleave<2>(const float * const *in, float *out, long samples)
+{
+	long i = 0;
+
+#if defined(OGG_SSE2)
+	for(; i + 4 <= samples; i += 4)
+	{
+		const __m128 l = _mm_loadu_ps(&in[0][i]);
+		const __m128 r = _mm_loadu_ps(&in[1][i]);
+		
+		_mm_storeu_ps(&out[i * 2], _mm_unpacklo_ps(l, r));
+		_mm_storeu_ps(&out[(i * 2) + 4], _mm_unpackhi_ps(l, r));
+	}
+#elif defined(OGG_NEON)
+	for(; i + 4 <= samples; i += 4)
+	{
+		float32x4x2_t v;
+		
+		v.val[0] = vld1q_f32(&in[0][i]);
+		v.val[1] = vld1q_f32(&in[1][i]);
+		
+		vst2q_f32(&out[i * 2], v);
+	}
+#endif
+
+	for(; i < samples; i++)
+	{
+		out[(i * 2) + 0] = in[0][i];
+		out[(i * 2) + 1] = in[1][i];
+	}
+}
+
+inline void
+interleave(int channels, const float * const *in, float *out, long samples)
+{
+	switch(channels)
+	{
+		case 1:		memcpy(out, in[0], sizeof(float) * samples);	break;
+		case 2:		interleave<2>(in, out, samples);				break;
+		case 6:		interleave<6>(in, out, samples);				break;
+		
+		default:
+			for(int c=0; c < channels; c++)
+			{
+				for(long i=0; i < samples; i++)
+					out[(i * channels) + c] = in[c][i];
+			}
+		break;
+	}
+}
+
+
+// out[i] = in[i] * scale, four at a time when we can
+inline void
+int_to_float(const int *in, float *out, long count, float scale)
+{
+	long i = 0;
+
+#if defined(OGG_SSE2)
+	const __m128 mult = _mm_set1_ps(scale);
+	
+	for(; i + 4 <= count; i += 4)
+	{
+		const __m128i ints = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+		
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(ints), mult));
+	}
+#elif defined(OGG_NEON)
+	const float32x4_t mult = vdupq_n_f32(scale);
+	
+	for(; i + 4 <= count; i += 4)
+	{
+		vst1q_f32(out + i, vmulq_f32(vcvtq_f32_s32(vld1q_s32(in + i)), mult));
+	}
+#endif
+
+	for(; i < count; i++)
+		out[i] = in[i] * scale;
+}
+
+
+// Floats to integers with this many bits, rounded and clipped.
+// Audio uses the full signed range, so an 8-bit sample can go from -128 to 127.
+// It's not balanced in positive and negative, but I guess that's OK?
+inline void
+float_to_int(const float *in, int *out, long count, int bits)
+{
+	const double multiplier = ldexp(1.0, bits - 1); // 1L << 31 overflows where long is 32 bits
+	
+	const double max_val = multiplier - 1.0;
+	const double min_val = -multiplier;
+	
+	for(long i=0; i < count; i++)
+	{
+		const double val = (double)in[i] * multiplier;
+		
+		out[i] = (int)(val >= 0 ?
+						(val < max_val ? (val + 0.5) : max_val) :
+						(val > min_val ? (val - 0.5) : min_val));
+	}
+}
+
+
+#endif // OGG_PREMIERE_CHANNELS_H
@@ -40,6 +40,8 @@
 
 #include "Ogg_Premiere_Export.h"
 
+#include "Ogg_Premiere_Channels.h"
+
 
 #ifdef PRMAC_ENV
 	#include <mach/mach.h>
@@ -446,22 +448,6 @@ OurEncoder::write_callback(const FLAC__byte buffer[], size_t bytes, unsigned sam
 //}
 
 
-static inline int
-AudioClip(double in, unsigned int max_val)
-{
-	// My understanding with audio is that it uses the full signed range.
-	// So an 8-bit sample is allowed to go from -128 to 127.  It's not
-	// balanced in positive and negative, but I guess that's OK?
-	return (in >= 0 ?
-				(in < (max_val - 1) ? (in + 0.5) : (max_val - 1)) :
-				(in > (-(int)max_val) ? (in - 0.5) : (-(int)max_val) )
-			);
-			
-	// BTW, the need to cast max_val into an int before the - operation
-	// was the source of a horrific bug I gave myself.  Sigh.
-}
-
-
 #define OV_OK 0
 
 static prMALError
@@ -618,18 +604,14 @@ exSDKExport(
 							
 							if(audioChannels > 2)
 							{
-								// copy Premiere audio to Vorbis buffer, swizzling channels
-								// Premiere uses Left, Right, Left Rear, Right Rear, Center, LFE
-								// Ogg uses Left, Center, Right, Left Read, Right Rear, LFE
-								// http://www.xiph.org/vorbis/doc/Vorbis_I_spec.html#x1-800004.3.9
-								static const int swizzle[] = {0, 4, 1, 2, 3, 5};
+								// copy Premiere audio to Vorbis buffer, in Vorbis channel order
+								float *src[6];
+								
+								to_layout_order(VORBIS_LAYOUT, audioChannels, prbuffer, src);
 								
 								for(int c=0; c < audioChannels; c++)
 								{
-									for(int i=0; i < samples; i++)
-									{
-										buffer[c][i] = prbuffer[swizzle[c]][i];
-									}
+									memcpy(buffer[c], src[c], samples * sizeof(float));
 								}
 							}
 						}
@@ -897,22 +879,12 @@ exSDKExport(
 						{
 							result = audioSuite->GetAudio(audioRenderID, samples, pr_buffer, false);
 						
-							// copy Premiere audio to Opus buffer, swizzling channels
-							// Premiere uses Left, Right, Left Rear, Right Rear, Center, LFE
-							// Opus uses Left, Center, Right, Left Read, Right Rear, LFE
-							// http://www.xiph.org/vorbis/doc/Vorbis_I_spec.html#x1-800004.3.9
-							static const int stereo_swizzle[] = {0, 1, 0, 1, 0, 1};
-							static const int surround_swizzle[] = {0, 4, 1, 2, 3, 5};
+							// copy Premiere audio to Opus buffer, interleaved in Opus channel order
+							float *src[6];
 							
-							const int *swizzle = (audioChannels > 2 ? surround_swizzle : stereo_swizzle);
+							to_layout_order(VORBIS_LAYOUT, audioChannels, pr_buffer, src);
 							
-							for(int c=0; c < audioChannels; c++)
-							{
-								for(int i=0; i < samples; i++)
-								{
-									stereo_buffer[(i * audioChannels) + c] = pr_buffer[swizzle[c]][i];
-								}
-							}
+							interleave(audioChannels, src, stereo_buffer, samples);
 						}
 							
 						if(result == malNoError)
@@ -1053,20 +1025,14 @@ exSDKExport(
 						
 						if(result == malNoError)
 						{
-							const double multiplier = (1L << (sampleSizeP.value.intValue - 1));
+							// Premiere's channels, in FLAC channel order
+							float *src[8];
+							
+							to_layout_order(FLAC_LAYOUT, audioChannels, float_buffers, src);
 							
 							for(int c=0; c < audioChannels; c++)
 							{
-								// for surround channels
-								// Premiere uses Left, Right, Left Rear, Right Rear, Center, LFE
-								// FLAC uses Left, Right, Center, LFE, Left Rear, Right Rear
-								// http://xiph.org/flac/format.html#frame_header
-								static const int swizzle[] = {0, 1, 4, 5, 2, 3};
-								
-								for(int i=0; i < samples_to_get; i++)
-								{
-									int_buffers[c][i] = AudioClip((double)float_buffers[swizzle[c]][i] * multiplier, multiplier);
-								}
+								float_to_int(src[c], reinterpret_cast<int *>(int_buffers[c]), samples_to_get, sampleSizeP.value.intValue);
 							}
 							
 							bool ok = encoder.process(int_buffers, samples_to_get);
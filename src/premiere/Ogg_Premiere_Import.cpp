@@ -37,8 +37,14 @@
 // ------------------------------------------------------------------------
 
 
+#include "Ogg_Premiere_Platform.h" // first, for _FILE_OFFSET_BITS
+
 #include "Ogg_Premiere_Import.h"
 
+#include "Ogg_Premiere_Cache.h"
+#include "Ogg_Premiere_SeekIndex.h"
+#include "Ogg_Premiere_Channels.h"
+
 
 #include <vorbis/codec.h>
 #include <vorbis/vorbisfile.h>
@@ -47,96 +53,130 @@
 
 #include "FLAC++/decoder.h"
 
-#include <assert.h>
 #include <math.h>
+#include <limits.h>
 
 #include <sstream>
+#include <string>
+#include <map>
+#include <set>
+#include <list>
+#include <vector>
 
 
 
 #define OV_OK	0
 
-static size_t ogg_read_func(void *ptr, size_t size, size_t nmemb, void *datasource)
+
+// This is what we hand the codec libraries as their file.
+// Seek and tell only move our position around.
+class FileStream
 {
-	imFileRef fp = static_cast<imFileRef>(datasource);
+  public:
+	FileStream(FileSource *source) : _source(source), _data(source->get_data()), _size(source->get_size()), _pos(0) {}
+	~FileStream() {}
 	
-#ifdef PRWIN_ENV	
-	DWORD count = size * nmemb, out;
+	// the same file, from somewhere else (or NULL while the file is closed)
+	void set_source(FileSource *source);
 	
-	BOOL result = ReadFile(fp, (LPVOID)ptr, count, &out, NULL);
-
-	return (out / size);
-#else
-	ByteCount count = size * nmemb, out = 0;
+	size_t read(void *buf, size_t len);
+	bool seek(ogg_int64_t offset, int whence);
+	ogg_int64_t tell() const { return _pos; }
+	ogg_int64_t size() const { return _size; }
 	
-	OSErr result = FSReadFork(CAST_REFNUM(fp), fsAtMark, 0, count, ptr, &out);
-
-	return (out / size);
-#endif
-}
+  private:
+	FileSource *_source;
+	const unsigned char *_data;
+	ogg_int64_t _size;
+	ogg_int64_t _pos;
+};
 
 
-static int ogg_seek_func(void *datasource, ogg_int64_t offset, int whence)
+void
+FileStream::set_source(FileSource *source)
 {
-	imFileRef fp = static_cast<imFileRef>(datasource);
+	_source = source;
+	_data = (source != NULL ? source->get_data() : NULL);
 	
-#ifdef PRWIN_ENV
-	LARGE_INTEGER lpos;
-
-	lpos.QuadPart = offset;
+	if(source != NULL)
+	{
+		assert(source->get_size() == _size);
+		
+		_size = source->get_size();
+	}
+}
 
-	DWORD method = ( whence == SEEK_SET ? FILE_BEGIN :
-						whence == SEEK_CUR ? FILE_CURRENT :
-						whence == SEEK_END ? FILE_END :
-						FILE_CURRENT );
 
-#if _MSC_VER < 1300
-	DWORD pos = SetFilePointer(fp, lpos.u.LowPart, &lpos.u.HighPart, method);
+size_t
+FileStream::read(void *buf, size_t len)
+{
+	size_t count = 0;
+	
+	if(_data != NULL)
+	{
+		// memory-resident files don't need to go through the source
+		if(_pos < _size)
+		{
+			count = (_size - _pos);
+			
+			if(count > len)
+				count = len;
+			
+			memcpy(buf, _data + _pos, count);
+		}
+	}
+	else if(_source != NULL)
+		count = _source->read(_pos, buf, len);
+	
+	_pos += count;
+	
+	return count;
+}
 
-	BOOL result = (pos != 0xFFFFFFFF || NO_ERROR == GetLastError());
-#else
-	BOOL result = SetFilePointerEx(fp, lpos, NULL, method);
-#endif
 
-	return (result ? OV_OK : OV_FALSE);
-#else
-	UInt16 positionMode = ( whence == SEEK_SET ? fsFromStart :
-							whence == SEEK_CUR ? fsFromMark :
-							whence == SEEK_END ? fsFromLEOF :
-							fsFromMark );
+bool
+FileStream::seek(ogg_int64_t offset, int whence)
+{
+	const ogg_int64_t new_pos = (whence == SEEK_SET ? offset :
+									whence == SEEK_CUR ? _pos + offset :
+									whence == SEEK_END ? size() + offset :
+									-1);
 	
-	OSErr result = FSSetForkPosition(CAST_REFNUM(fp), positionMode, offset);
-
-	return (result == noErr ? OV_OK : OV_FALSE);
-#endif
+	if(new_pos < 0)
+		return false;
+	
+	_pos = new_pos;
+	
+	return true;
 }
 
 
-static long ogg_tell_func(void *datasource)
+static size_t ogg_read_func(void *ptr, size_t size, size_t nmemb, void *datasource)
 {
-	imFileRef fp = static_cast<imFileRef>(datasource);
+	FileStream *stream = static_cast<FileStream *>(datasource);
 	
-#ifdef PRWIN_ENV
-	long pos;
-	LARGE_INTEGER lpos, zero;
-
-	zero.QuadPart = 0;
+	return (stream->read(ptr, size * nmemb) / size);
+}
 
-	BOOL result = SetFilePointerEx(fp, zero, &lpos, FILE_CURRENT);
 
-	pos = lpos.QuadPart;
+static int ogg_seek_func(void *datasource, ogg_int64_t offset, int whence)
+{
+	FileStream *stream = static_cast<FileStream *>(datasource);
 	
-	return pos;
-#else
-	long pos;
-	SInt64 lpos;
+	return (stream->seek(offset, whence) ? OV_OK : OV_FALSE);
+}
+
 
-	OSErr result = FSGetForkPosition(CAST_REFNUM(fp), &lpos);
+static long ogg_tell_func(void *datasource)
+{
+	FileStream *stream = static_cast<FileStream *>(datasource);
 	
-	pos = lpos;
+	const ogg_int64_t pos = stream->tell();
 	
-	return pos;
-#endif
+	// libvorbisfile's tell callback returns a long, which is only 32 bits on Windows,
+	// so it can't describe a position past 2 GB.  open_decoder() turns those files away
+	// before we get here, but an error beats handing back a wrapped-around offset.
+	return (pos > LONG_MAX ? -1 : static_cast<long>(pos));
 }
 
 static ov_callbacks g_ov_callbacks = { ogg_read_func, ogg_seek_func, NULL, ogg_tell_func };
@@ -157,26 +197,115 @@ static int opusfile_seek_func(void *_stream, opus_int64 _offset, int _whence)
 
 static opus_int64 opusfile_tell_func(void *_stream)
 {
-	imFileRef fp = static_cast<imFileRef>(_stream);
+	FileStream *stream = static_cast<FileStream *>(_stream);
 	
-#ifdef PRWIN_ENV
-	LARGE_INTEGER lpos, zero;
+	return stream->tell();
+}
 
-	zero.QuadPart = 0;
+static OpusFileCallbacks g_opusfile_callbacks = { opusfile_read_func, opusfile_seek_func, opusfile_tell_func, NULL };
 
-	BOOL result = SetFilePointerEx(fp, zero, &lpos, FILE_CURRENT);
 
-	return lpos.QuadPart;
-#else
-	SInt64 lpos;
+// Cheaper Opus for playback.  Opus can decode at a lower rate, which skips the work for
+// the high end, so we decode at 24k with our own decoder and double it back up to 48k.
+// opusfile still does everything else (seeking, pre-skip, trimming).
+typedef struct
+{
+	OggOpusFile		*opus;
+	bool			enabled;
+	OpusMSDecoder	*decoder; // ours, NULL until we need it
+	int				link; // which one it was made for
+	float			last[8]; // the sample before this packet, to interpolate from
+	std::vector<float> buffer;
+} OpusPreview;
+
+enum {
+	PREVIEW_RATE		= 24000,
+	PREVIEW_MAX_SAMPLES	= 48000 // renders and exports ask for more than this at a time
+};
+
 
-	OSErr result = FSGetForkPosition(CAST_REFNUM(fp), &lpos);
+static void
+reset_opus_preview(OpusPreview *preview)
+{
+	if(preview->decoder != NULL)
+		opus_multistream_decoder_ctl(preview->decoder, OPUS_RESET_STATE);
 	
-	return lpos;
-#endif
+	memset(preview->last, 0, sizeof(preview->last));
 }
 
-static OpusFileCallbacks g_opusfile_callbacks = { opusfile_read_func, opusfile_seek_func, opusfile_tell_func, NULL };
+
+// opusfile's decode callback.  It hands us its own full-rate decoder, which we don't use.
+static int
+opus_preview_decode(void *ctx, OpusMSDecoder *, void *pcm, const ogg_packet *op,
+						int nsamples, int nchannels, int format, int li)
+{
+	OpusPreview *preview = static_cast<OpusPreview *>(ctx);
+	
+	if(!preview->enabled || format != OP_DEC_FORMAT_FLOAT || (nsamples % 2) != 0 || nchannels > 8)
+		return OP_DEC_USE_DEFAULT;
+	
+	if(preview->decoder == NULL || preview->link != li)
+	{
+		if(preview->decoder != NULL)
+			opus_multistream_decoder_destroy(preview->decoder);
+		
+		preview->decoder = NULL;
+		
+		const OpusHead *head = op_head(preview->opus, li);
+		
+		if(head == NULL || head->channel_count != nchannels)
+			return OP_DEC_USE_DEFAULT;
+		
+		int err = OPUS_OK;
+		
+		preview->decoder = opus_multistream_decoder_create(PREVIEW_RATE, head->channel_count,
+															head->stream_count, head->coupled_count,
+															head->mapping, &err);
+		
+		if(preview->decoder == NULL || err != OPUS_OK)
+		{
+			preview->decoder = NULL;
+			
+			return OP_DEC_USE_DEFAULT;
+		}
+		
+		opus_multistream_decoder_ctl(preview->decoder, OPUS_SET_GAIN(head->output_gain));
+		
+		preview->link = li;
+		
+		memset(preview->last, 0, sizeof(preview->last));
+	}
+	
+	const int half = nsamples / 2;
+	
+	preview->buffer.resize(half * nchannels);
+	
+	const int decoded = opus_multistream_decode_float(preview->decoder, op->packet, op->bytes,
+														&preview->buffer[0], half, 0);
+	
+	if(decoded != half)
+		return OP_DEC_USE_DEFAULT;
+	
+	// halfway between each sample and the one before
+	float *out = static_cast<float *>(pcm);
+	
+	const float *in = &preview->buffer[0];
+	
+	for(int i=0; i < half; i++)
+	{
+		for(int c=0; c < nchannels; c++)
+		{
+			const float sample = in[(i * nchannels) + c];
+			
+			out[(2 * i * nchannels) + c] = 0.5f * (preview->last[c] + sample);
+			out[(((2 * i) + 1) * nchannels) + c] = sample;
+			
+			preview->last[c] = sample;
+		}
+	}
+	
+	return 0;
+}
 
 
 #pragma mark-
@@ -185,16 +314,43 @@ static OpusFileCallbacks g_opusfile_callbacks = { opusfile_read_func, opusfile_s
 class OurDecoder : public FLAC::Decoder::Stream
 {
   public:
-	OurDecoder(imFileRef fp): FLAC::Decoder::Stream(), _fp(fp), _buffers(NULL), _pos(0), _channels(0), _sample_rate(0), _bits_per_sample(0) { }
-	virtual ~OurDecoder() {}
+	OurDecoder(FileStream *stream): FLAC::Decoder::Stream(), _stream(stream), _buffers(NULL), _pos(0), _next_sample(0),
+									_skipped_ahead(false), _approximate(false),
+									_remainder(NULL), _remainder_size(0), _remainder_start(0), _remainder_len(0),
+									_channels(0), _sample_rate(0), _bits_per_sample(0),
+									_total_samples(0), _seek_points(0) { }
+	virtual ~OurDecoder() { if(_remainder) free(_remainder); }
 	
 	unsigned get_channels() const { return _channels; }
 	unsigned get_sample_rate() const { return _sample_rate; }
 	unsigned get_bits_per_sample() const { return _bits_per_sample; }
 	
-	void set_buffers(float **buffers, size_t buf_len, FLAC__uint64 start_sample) { _buffers = buffers; _buf_len = buf_len; _start_sample = start_sample; _pos = 0; }
+	void set_buffers(float **buffers, size_t buf_len, FLAC__uint64 start_sample) { _buffers = buffers; _buf_len = buf_len; _start_sample = start_sample; _pos = 0; _skipped_ahead = false; }
 	size_t get_pos() const { return _pos; }
 	
+	// copy whatever we can from the end of the last frame into the buffers
+	void read_remainder();
+	
+	// the first sample of the next frame we'll decode, -1 if we don't know
+	FLAC__int64 get_next_sample() const { return _next_sample; }
+	void forget_next_sample() { _next_sample = -1; _remainder_len = 0; }
+	
+	// Start decoding at the frame that begins at this byte offset.  Frames that end before
+	// the sample we want get thrown away, and if we land after it, skipped_ahead() says so.
+	bool seek_to_frame(FLAC__uint64 offset);
+	bool skipped_ahead() const { return _skipped_ahead; }
+	
+	// For scrubbing, the buffers take frames as they come, wherever they start
+	void set_approximate(bool approximate) { _approximate = approximate; }
+	
+	// True if the file has a SEEKTABLE good enough for seek_absolute() to be quick,
+	// at least one point every 10 seconds.  Otherwise libFLAC bisects the whole file.
+	bool has_seek_table() const;
+	
+	// Frames we've decoded so far, about a second apart.  Until there's a seek index
+	// for the file, this gets us close without libFLAC's bisection.
+	bool find_frame(FLAC__uint64 sample, FLAC__uint64 *frame_sample, FLAC__uint64 *offset) const;
+	
   protected:
 	virtual ::FLAC__StreamDecoderReadStatus read_callback(FLAC__byte buffer[], size_t *bytes);
 	virtual ::FLAC__StreamDecoderSeekStatus seek_callback(FLAC__uint64 absolute_byte_offset);
@@ -209,7 +365,7 @@ class OurDecoder : public FLAC::Decoder::Stream
 	virtual void error_callback(::FLAC__StreamDecoderErrorStatus status) { throw status; }
 	
   private:
-	imFileRef _fp;
+	FileStream *_stream;
 	
 	float **_buffers;
 	
@@ -217,159 +373,265 @@ class OurDecoder : public FLAC::Decoder::Stream
 	size_t _buf_len;
 	FLAC__uint64 _start_sample;
 	
+	FLAC__int64 _next_sample;
+	
+	bool _skipped_ahead;
+	bool _approximate;
+	
+	// The part of the last frame that didn't fit in the buffers.  Premiere asks
+	// for audio in pieces smaller than a frame, so the next request usually starts here.
+	float *_remainder; // channel after channel, _remainder_size samples each
+	size_t _remainder_size;
+	FLAC__uint64 _remainder_start;
+	size_t _remainder_len;
+	
 	unsigned _channels;
 	unsigned _sample_rate;
 	unsigned _bits_per_sample;
+	
+	FLAC__uint64 _total_samples;
+	unsigned _seek_points; // not counting placeholders
+	
+	void remember_frame(FLAC__uint64 sample, FLAC__uint64 offset);
+	
+	typedef std::map<FLAC__uint64, FLAC__uint64> FrameMap; // sample -> offset
+	FrameMap _frames;
 };
 
 
 ::FLAC__StreamDecoderReadStatus
 OurDecoder::read_callback(FLAC__byte buffer[], size_t *bytes)
 {
-#ifdef PRWIN_ENV	
-	DWORD count = *bytes, out;
-	
-	BOOL result = ReadFile(_fp, (LPVOID)buffer, count, &out, NULL);
-
-	*bytes = out;
-	
-	if(!result)
-	{
-		DWORD err = GetLastError();
-		
-		return (err == ERROR_HANDLE_EOF ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM :
-					FLAC__STREAM_DECODER_READ_STATUS_ABORT);
-	}
-
-	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
-#else
-	ByteCount count = *bytes, out = 0;
+	const size_t count = *bytes;
 	
-	OSErr result = FSReadFork(CAST_REFNUM(_fp), fsAtMark, 0, count, buffer, &out);
-
-	*bytes = out;
+	*bytes = _stream->read(buffer, count);
 	
-	return (result == noErr ? FLAC__STREAM_DECODER_READ_STATUS_CONTINUE :
-			result == eofErr ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM :
+	return (*bytes > 0 ? FLAC__STREAM_DECODER_READ_STATUS_CONTINUE :
+			_stream->tell() >= _stream->size() ? FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM :
 			FLAC__STREAM_DECODER_READ_STATUS_ABORT);
-#endif
 }
 
 
 ::FLAC__StreamDecoderSeekStatus
 OurDecoder::seek_callback(FLAC__uint64 absolute_byte_offset)
 {
-	int status = ogg_seek_func(_fp, absolute_byte_offset, SEEK_SET);
+	bool sought = _stream->seek(absolute_byte_offset, SEEK_SET);
 	
-	return (status == OV_OK ? FLAC__STREAM_DECODER_SEEK_STATUS_OK : FLAC__STREAM_DECODER_SEEK_STATUS_ERROR);
+	return (sought ? FLAC__STREAM_DECODER_SEEK_STATUS_OK : FLAC__STREAM_DECODER_SEEK_STATUS_ERROR);
 }
 
 
 ::FLAC__StreamDecoderLengthStatus
 OurDecoder::length_callback(FLAC__uint64 *stream_length)
 {
-#ifdef PRWIN_ENV
-	LARGE_INTEGER lpos;
-
-	BOOL result = GetFileSizeEx(_fp, &lpos);
-	
-	*stream_length = lpos.QuadPart;
-	
-	return (result ? FLAC__STREAM_DECODER_LENGTH_STATUS_OK : FLAC__STREAM_DECODER_LENGTH_STATUS_ERROR);
-#else
-	SInt64 fork_size = 0;
-	
-	OSErr result = FSGetForkSize(CAST_REFNUM(_fp), &fork_size);
-		
-	*stream_length = fork_size;
+	*stream_length = _stream->size();
 	
-	return (result == noErr ? FLAC__STREAM_DECODER_LENGTH_STATUS_OK : FLAC__STREAM_DECODER_LENGTH_STATUS_ERROR);
-#endif
+	return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
 }
 
 
 ::FLAC__StreamDecoderTellStatus
 OurDecoder::tell_callback(FLAC__uint64 *absolute_byte_offset)
 {
-#ifdef PRWIN_ENV
-	LARGE_INTEGER lpos, zero;
-
-	zero.QuadPart = 0;
-
-	BOOL result = SetFilePointerEx(_fp, zero, &lpos, FILE_CURRENT);
-
-	*absolute_byte_offset = lpos.QuadPart;
-	
-	return (result ? FLAC__STREAM_DECODER_TELL_STATUS_OK : FLAC__STREAM_DECODER_TELL_STATUS_ERROR);
-#else
-	SInt64 lpos;
-
-	OSErr result = FSGetForkPosition(CAST_REFNUM(_fp), &lpos);
+	*absolute_byte_offset = _stream->tell();
 	
-	*absolute_byte_offset = lpos;
-	
-	return (result == noErr ? FLAC__STREAM_DECODER_TELL_STATUS_OK : FLAC__STREAM_DECODER_TELL_STATUS_ERROR);
-#endif
+	return FLAC__STREAM_DECODER_TELL_STATUS_OK;
 }
 
 
 bool
 OurDecoder::eof_callback()
 {
-	FLAC__uint64 len = 0, pos = 0;
-	
-	length_callback(&len);
-	tell_callback(&pos);
-	
-	return (pos >= len);
+	return (_stream->tell() >= _stream->size());
 }
 
 
 ::FLAC__StreamDecoderWriteStatus
 OurDecoder::write_callback(const ::FLAC__Frame *frame, const FLAC__int32 * const buffer[])
 {
-	if(_buffers != NULL)
+	// the frame's channels in Premiere's order
+	const FLAC__int32 *channel[FLAC__MAX_CHANNELS];
+	
+	to_premiere_order(FLAC_LAYOUT, get_channels(), buffer, channel);
+	
+	
+	assert(frame->header.number_type == FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER);
+	
+	const int blocksize = frame->header.blocksize;
+	
+	const float scale = (float)ldexp(1.0, 1 - (int)frame->header.bits_per_sample);
+	
+	int used = 0; // samples from this frame that went into the buffers
+	
+	// the next sample the buffers need
+	const FLAC__uint64 wanted = (_approximate ? frame->header.number.sample_number : _start_sample + _pos);
+	
+	if(_buffers != NULL && frame->header.number.sample_number > wanted)
 	{
-		// for surround channels
-		// Premiere uses Left, Right, Left Rear, Right Rear, Center, LFE
-		// FLAC uses Left, Right, Center, LFE, Left Rear, Right Rear
-		// http://xiph.org/flac/format.html#frame_header
-		static const int swizzle[] = {0, 1, 4, 5, 2, 3};
-		
-		
-		assert(frame->header.number_type == FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER);
-		
-		int buffer_offset = 0;
+		_skipped_ahead = true; // everything goes in the remainder
+	}
+	else if(_buffers != NULL)
+	{
+		// After seek_to_frame(), we'll get frames that start before what we want
+		FLAC__uint64 skip = wanted - frame->header.number.sample_number;
 		
-		if(_start_sample > frame->header.number.sample_number)
-			buffer_offset = _start_sample - frame->header.number.sample_number;
+		const int buffer_offset = (skip < (FLAC__uint64)blocksize ? skip : blocksize);
 		
-		assert(buffer_offset == 0); // I think I would sometimes get a non-zero offset, but haven't seen it yet
+		int samples = _buf_len - _pos;
 		
-		assert(_start_sample + buffer_offset + _pos == frame->header.number.sample_number);
+		if(samples > blocksize - buffer_offset)
+			samples = blocksize - buffer_offset;
 		
-		int samples = _buf_len - _pos;
+		// one channel at a time
+		for(unsigned int c=0; c < get_channels(); c++)
+		{
+			int_to_float(reinterpret_cast<const int *>(channel[c] + buffer_offset),
+							&_buffers[c][_pos], samples, scale);
+		}
 		
-		if(samples > frame->header.blocksize - buffer_offset)
-			samples = frame->header.blocksize - buffer_offset;
+		_pos += samples;
 		
-		double divisor = (1L << (frame->header.bits_per_sample - 1));
+		used = buffer_offset + samples;
+	}
+	
+	
+	// hold on to the rest of the frame for next time
+	_remainder_len = 0;
+	
+	const int leftover = blocksize - used;
+	
+	if(leftover > 0)
+	{
+		if((size_t)leftover > _remainder_size)
+		{
+			float *new_remainder = (float *)realloc(_remainder, sizeof(float) * leftover * get_channels());
+			
+			if(new_remainder != NULL)
+			{
+				_remainder = new_remainder;
+				_remainder_size = leftover;
+			}
+		}
 		
-		for(int i = 0; i < samples; i++)
+		if((size_t)leftover <= _remainder_size)
 		{
-			for(int c=0; c < get_channels(); c++)
+			for(unsigned int c=0; c < get_channels(); c++)
 			{
-				_buffers[c][_pos] = (double)buffer[swizzle[c]][i + buffer_offset] / divisor;
+				int_to_float(reinterpret_cast<const int *>(channel[c] + used),
+								&_remainder[c * _remainder_size], leftover, scale);
 			}
 			
-			_pos++;
+			_remainder_start = frame->header.number.sample_number + used;
+			_remainder_len = leftover;
 		}
 	}
 	
+	_next_sample = frame->header.number.sample_number + blocksize;
+	
+	// we've read to the end of this frame, which is where the next one starts
+	FLAC__uint64 next_offset = 0;
+	
+	if( get_decode_position(&next_offset) )
+		remember_frame(_next_sample, next_offset);
+	
 	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
 }
 
 
+bool
+OurDecoder::has_seek_table() const
+{
+	if(_seek_points == 0 || _total_samples == 0 || _sample_rate == 0)
+		return false;
+	
+	return ((FLAC__uint64)_seek_points * _sample_rate * 10 >= _total_samples);
+}
+
+
+void
+OurDecoder::remember_frame(FLAC__uint64 sample, FLAC__uint64 offset)
+{
+	if(has_seek_table() || (_total_samples > 0 && sample >= _total_samples))
+		return;
+	
+	const FLAC__uint64 spacing = (_sample_rate > 0 ? _sample_rate : 48000);
+	
+	// don't bother if we already have one nearby
+	FrameMap::const_iterator next = _frames.lower_bound(sample);
+	
+	if(next != _frames.end() && next->first - sample < spacing)
+		return;
+	
+	if(next != _frames.begin())
+	{
+		FrameMap::const_iterator prev = next;
+		
+		prev--;
+		
+		if(sample - prev->first < spacing)
+			return;
+	}
+	
+	_frames[sample] = offset;
+}
+
+
+bool
+OurDecoder::find_frame(FLAC__uint64 sample, FLAC__uint64 *frame_sample, FLAC__uint64 *offset) const
+{
+	FrameMap::const_iterator next = _frames.upper_bound(sample);
+	
+	if(next == _frames.begin())
+		return false;
+	
+	next--;
+	
+	*frame_sample = next->first;
+	*offset = next->second;
+	
+	return true;
+}
+
+
+bool
+OurDecoder::seek_to_frame(FLAC__uint64 offset)
+{
+	if( !flush() )
+		return false;
+	
+	forget_next_sample();
+	
+	return _stream->seek(offset, SEEK_SET);
+}
+
+
+void
+OurDecoder::read_remainder()
+{
+	if(_buffers == NULL || _remainder_len == 0)
+		return;
+	
+	const FLAC__uint64 sample = _start_sample + _pos;
+	
+	if(sample >= _remainder_start && sample < (_remainder_start + _remainder_len))
+	{
+		const size_t offset = (sample - _remainder_start);
+		
+		size_t samples = _remainder_len - offset;
+		
+		if(samples > (_buf_len - _pos))
+			samples = (_buf_len - _pos);
+		
+		for(unsigned int c=0; c < get_channels(); c++)
+		{
+			memcpy(&_buffers[c][_pos], &_remainder[(c * _remainder_size) + offset], samples * sizeof(float));
+		}
+		
+		_pos += samples;
+	}
+}
+
+
 void
 OurDecoder::metadata_callback(const ::FLAC__StreamMetadata *metadata)
 {
@@ -378,6 +640,19 @@ OurDecoder::metadata_callback(const ::FLAC__StreamMetadata *metadata)
 		_channels = metadata->data.stream_info.channels;
 		_sample_rate = metadata->data.stream_info.sample_rate;
 		_bits_per_sample = metadata->data.stream_info.bits_per_sample;
+		_total_samples = metadata->data.stream_info.total_samples;
+	}
+	else if(metadata->type == FLAC__METADATA_TYPE_SEEKTABLE)
+	{
+		const FLAC__StreamMetadata_SeekTable &table = metadata->data.seek_table;
+		
+		_seek_points = 0;
+		
+		for(unsigned i=0; i < table.num_points; i++)
+		{
+			if(table.points[i].sample_number != FLAC__STREAM_METADATA_SEEKPOINT_PLACEHOLDER)
+				_seek_points++;
+		}
 	}
 }
 
@@ -395,44 +670,225 @@ typedef PrSDKPPixCacheSuite PrCacheSuite;
 
 
 
-typedef struct
-{	
-	csSDK_int32				importerID;
-	csSDK_int32				fileType;
-	int						numChannels;
-	float					audioSampleRate;
-	
-	OggVorbis_File			*vf;
-	OggOpusFile				*opus;
-	OurDecoder				*flac;
-	
-} ImporterLocalRec8, *ImporterLocalRec8Ptr, **ImporterLocalRec8H;
+#pragma mark-
 
 
-static const csSDK_int32 Ogg_filetype = 'OggV';
-static const csSDK_int32 Opus_filetype = 'Opus';
-static const csSDK_int32 FLAC_filetype = 'FLAC';
+// Chained Ogg files (radio captures, recordings stuck end to end) are a series of links, each
+// its own stream that can have a different number of channels.  The libraries know where they
+// all are once the file is open, so we copy that into a table where finding the link for a
+// sample is a binary search.  Sample numbers count from the start of the whole file.
+typedef struct
+{
+	ogg_int64_t		sample;		// first sample in the link
+	ogg_int64_t		samples;
+	ogg_int64_t		offset;		// first byte
+	ogg_int64_t		bytes;
+	int				channels;
+	int				sampleRate;
+} OggLink;
 
 
-static prMALError 
-SDKInit(
-	imStdParms		*stdParms, 
-	imImportInfoRec	*importInfo)
+class LinkTable
 {
-	importInfo->canSave				= kPrFalse;		// Can 'save as' files to disk, real file only.
-	importInfo->canDelete			= kPrFalse;		// File importers only, use if you only if you have child files
-	importInfo->canCalcSizes		= kPrFalse;		// These are for importers that look at a whole tree of files so
-													// Premiere doesn't know about all of them.
-	importInfo->canTrim				= kPrFalse;
+  public:
+	static LinkTable * build(OggVorbis_File *vf);
+	static LinkTable * build(OggOpusFile *opus);
 	
-	importInfo->hasSetup			= kPrFalse;		// Set to kPrTrue if you have a setup dialog
-	importInfo->setupOnDblClk		= kPrFalse;		// If user dbl-clicks file you imported, pop your setup dialog
+	int count() const { return _links.size(); }
 	
-	importInfo->dontCache			= kPrFalse;		// Don't let Premiere cache these files
-	importInfo->keepLoaded			= kPrFalse;		// If you MUST stay loaded use, otherwise don't: play nice
-	importInfo->priority			= 0;
+	const OggLink & operator [] (int i) const { return _links[i]; }
 	
-	importInfo->avoidAudioConform	= kPrTrue;		// If I let Premiere conform the audio, I get silence when
+	int find(ogg_int64_t sample) const; // which link has this sample
+	
+	int max_channels() const;
+	int min_channels() const;
+	
+  private:
+	LinkTable() {}
+	
+	void add(ogg_int64_t samples, ogg_int64_t bytes, int channels, int sampleRate);
+	
+	std::vector<OggLink> _links;
+};
+
+
+void
+LinkTable::add(ogg_int64_t samples, ogg_int64_t bytes, int channels, int sampleRate)
+{
+	OggLink link;
+	
+	link.sample = (_links.empty() ? 0 : _links.back().sample + _links.back().samples);
+	link.samples = samples;
+	link.offset = (_links.empty() ? 0 : _links.back().offset + _links.back().bytes);
+	link.bytes = bytes;
+	link.channels = channels;
+	link.sampleRate = sampleRate;
+	
+	_links.push_back(link);
+}
+
+
+LinkTable *
+LinkTable::build(OggVorbis_File *vf)
+{
+	LinkTable *table = new LinkTable;
+	
+	for(int i=0; i < ov_streams(vf); i++)
+	{
+		vorbis_info *vinfo = ov_info(vf, i);
+		
+		table->add(ov_pcm_total(vf, i), ov_raw_total(vf, i),
+					(vinfo != NULL ? vinfo->channels : 0), (vinfo != NULL ? vinfo->rate : 0));
+	}
+	
+	return table;
+}
+
+
+LinkTable *
+LinkTable::build(OggOpusFile *opus)
+{
+	LinkTable *table = new LinkTable;
+	
+	for(int i=0; i < op_link_count(opus); i++)
+	{
+		const OpusHead *head = op_head(opus, i);
+		
+		table->add(op_pcm_total(opus, i), op_raw_total(opus, i),
+					(head != NULL ? head->channel_count : 0), 48000);
+	}
+	
+	return table;
+}
+
+
+int
+LinkTable::find(ogg_int64_t sample) const
+{
+	int lo = 0, hi = count() - 1;
+	
+	while(lo < hi)
+	{
+		const int mid = (lo + hi + 1) / 2;
+		
+		if(_links[mid].sample <= sample)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	
+	return lo;
+}
+
+
+int
+LinkTable::max_channels() const
+{
+	int channels = 0;
+	
+	for(std::vector<OggLink>::const_iterator i = _links.begin(); i != _links.end(); ++i)
+	{
+		if(i->channels > channels)
+			channels = i->channels;
+	}
+	
+	return channels;
+}
+
+
+int
+LinkTable::min_channels() const
+{
+	int channels = (_links.empty() ? 0 : _links.front().channels);
+	
+	for(std::vector<OggLink>::const_iterator i = _links.begin(); i != _links.end(); ++i)
+	{
+		if(i->channels < channels)
+			channels = i->channels;
+	}
+	
+	return channels;
+}
+
+
+class DiskCacheBuilder;
+class DecoderPool;
+class ReadAhead;
+
+static void delete_disk_builder(DiskCacheBuilder *builder);
+static void delete_read_ahead(ReadAhead *read_ahead);
+
+enum { REQUEST_STREAMS = 4 }; // tracks playing the same clip that we can tell apart
+
+typedef struct
+{	
+	csSDK_int32				importerID;
+	csSDK_int32				fileType;
+	int						numChannels;
+	float					audioSampleRate;
+	
+	FileSource				*source;
+	FileStream				*stream;
+	
+	OggVorbis_File			*vf;
+	OggOpusFile				*opus;
+	bool					opusMemory; // opened with op_open_memory(), which reads the source's memory itself
+	OurDecoder				*flac;
+	LinkTable				*links; // for Vorbis and Opus
+	
+	ogg_int64_t				pcmPosition; // where the decoder is now, -1 if unknown
+	ogg_int64_t				requestEnds[REQUEST_STREAMS]; // where recent audio requests ended
+	int						lastRequest; // the one in there that was most recent
+	int						scrubJumps; // small requests in a row that didn't follow any of those
+	
+	FileIdentity			identity;
+	ClipInfo				info; // what imGetInfo8 needs, from the decoder or the disk cache
+	bool					haveInfo; // info is for the file we have now
+	bool					infoProbed; // ...but only from the headers, the decoder hasn't checked it
+	SeekIndex				*seekIndex; // NULL until we've built or loaded one
+	IndexBuilder			*indexBuilder; // scanning for the index in the background
+	SeekIndex				*partialIndex; // what a scan got done before it was stopped
+	bool					indexFailed; // the file can't be indexed, don't keep trying
+	float					*blockBuffer; // for decoding blocks that go into the cache
+	float					*opusWindow; // op_read_float() goes here, OPUS_WINDOW samples interleaved
+	
+	prUTF16Char				*filePath; // our copy
+	ConformedAudio			*conformed; // from the disk cache
+	DiskCacheBuilder		*diskBuilder; // while we make that
+	bool					diskCacheFailed;
+	DecoderPool				*decoderPool; // more decoders for the same clip
+	OpusPreview				*opusPreview; // NULL unless fast preview is turned on
+	ReadAhead				*readAhead; // decoding what playback will want next
+	unsigned int			parkedTicket; // gets the decoder back after imQuietFile, 0 if it wasn't kept
+	Mutex					*clipMutex; // for all of the above, when Premiere calls from more than one thread
+	
+} ImporterLocalRec8, *ImporterLocalRec8Ptr, **ImporterLocalRec8H;
+
+
+static const csSDK_int32 Ogg_filetype = 'OggV';
+static const csSDK_int32 Opus_filetype = 'Opus';
+static const csSDK_int32 FLAC_filetype = 'FLAC';
+
+
+static prMALError 
+SDKInit(
+	imStdParms		* /*stdParms*/, 
+	imImportInfoRec	*importInfo)
+{
+	importInfo->canSave				= kPrFalse;		// Can 'save as' files to disk, real file only.
+	importInfo->canDelete			= kPrFalse;		// File importers only, use if you only if you have child files
+	importInfo->canCalcSizes		= kPrFalse;		// These are for importers that look at a whole tree of files so
+													// Premiere doesn't know about all of them.
+	importInfo->canTrim				= kPrFalse;
+	
+	importInfo->hasSetup			= kPrFalse;		// Set to kPrTrue if you have a setup dialog
+	importInfo->setupOnDblClk		= kPrFalse;		// If user dbl-clicks file you imported, pop your setup dialog
+	
+	importInfo->dontCache			= kPrFalse;		// Don't let Premiere cache these files
+	importInfo->keepLoaded			= kPrFalse;		// If you MUST stay loaded use, otherwise don't: play nice
+	importInfo->priority			= 0;
+	
+	importInfo->avoidAudioConform	= kPrTrue;		// If I let Premiere conform the audio, I get silence when
 													// I try to play it in the program.  Seems like a bug to me.
 
 	return malNoError;
@@ -441,7 +897,7 @@ SDKInit(
 
 static prMALError 
 SDKGetIndFormat(
-	imStdParms		*stdParms, 
+	imStdParms		* /*stdParms*/, 
 	csSDK_size_t	index, 
 	imIndFormatRec	*SDKIndFormatRec)
 {
@@ -531,398 +987,2873 @@ SDKGetIndFormat(
 }
 
 
-prMALError 
-SDKOpenFile8(
-	imStdParms		*stdParms, 
-	imFileRef		*SDKfileRef, 
-	imFileOpenRec8	*SDKfileOpenRec8)
+// Opens the decoder for the clip's type on a source, which it takes over.  The builder
+// for the disk cache uses this too, with its own file handle and ImporterLocalRec8.
+static prMALError
+open_decoder(ImporterLocalRec8Ptr localRecP, FileSource *source)
 {
-	prMALError			result = malNoError;
-
-	ImporterLocalRec8H	localRecH = NULL;
-	ImporterLocalRec8Ptr localRecP = NULL;
-
-	if(SDKfileOpenRec8->privatedata)
+	prMALError result = malNoError;
+	
+	localRecP->source = source;
+	localRecP->stream = new FileStream(localRecP->source);
+	
+	if(localRecP->fileType == Ogg_filetype && localRecP->source->get_size() > LONG_MAX)
 	{
-		localRecH = (ImporterLocalRec8H)SDKfileOpenRec8->privatedata;
-
-		stdParms->piSuites->memFuncs->lockHandle(reinterpret_cast<char**>(localRecH));
-
-		localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *localRecH );
+		// libvorbisfile gets the file length through a tell callback that returns a long.
+		// Where that's 32 bits (Windows) a Vorbis file over 2 GB can't be opened
+		// correctly, so say so instead of quietly cutting the clip short.
+		// Opus and FLAC use 64-bit offsets all the way and aren't affected.
+		result = imBadFile;
 	}
-	else
+	else if(localRecP->fileType == Ogg_filetype)
 	{
-		localRecH = (ImporterLocalRec8H)stdParms->piSuites->memFuncs->newHandle(sizeof(ImporterLocalRec8));
-		SDKfileOpenRec8->privatedata = (PrivateDataPtr)localRecH;
-
-		stdParms->piSuites->memFuncs->lockHandle(reinterpret_cast<char**>(localRecH));
-
-		localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *localRecH );
+		localRecP->vf = new OggVorbis_File;
+	
+		OggVorbis_File &vf = *localRecP->vf;
 		
-		localRecP->vf = NULL;
-		localRecP->opus = NULL;
-		localRecP->flac = NULL;
+		int ogg_err = ov_open_callbacks(static_cast<void *>(localRecP->stream), &vf, NULL, 0, g_ov_callbacks);
 		
-		localRecP->importerID = SDKfileOpenRec8->inImporterID;
-		localRecP->fileType = SDKfileOpenRec8->fileinfo.filetype;
-	}
-
-
-	SDKfileOpenRec8->fileinfo.fileref = *SDKfileRef = reinterpret_cast<imFileRef>(imInvalidHandleValue);
-
-
-	if(localRecP)
-	{
-		const prUTF16Char *path = SDKfileOpenRec8->fileinfo.filepath;
-	
-	#ifdef PRWIN_ENV
-		HANDLE fileH = CreateFileW(path,
-									GENERIC_READ,
-									FILE_SHARE_READ,
-									NULL,
-									OPEN_EXISTING,
-									FILE_ATTRIBUTE_NORMAL,
-									NULL);
-									
-		if(fileH != imInvalidHandleValue)
+		if(ogg_err == OV_OK)
 		{
-			SDKfileOpenRec8->fileinfo.fileref = *SDKfileRef = fileH;
-		}
-		else
-			result = imFileOpenFailed;
-	#else
-		FSIORefNum refNum = CAST_REFNUM(imInvalidHandleValue);
+			if( ov_streams(&vf) == 0 )
+			{
+				result = imFileHasNoImportableStreams;
 				
-		CFStringRef filePathCFSR = CFStringCreateWithCharacters(NULL, path, prUTF16CharLength(path));
-													
-		CFURLRef filePathURL = CFURLCreateWithFileSystemPath(NULL, filePathCFSR, kCFURLPOSIXPathStyle, false);
-		
-		if(filePathURL != NULL)
-		{
-			FSRef fileRef;
-			Boolean success = CFURLGetFSRef(filePathURL, &fileRef);
-			
-			if(success)
+				ov_clear(&vf);
+			}
+			else if( !ov_seekable(&vf) )
 			{
-				HFSUniStr255 dataForkName;
-				FSGetDataForkName(&dataForkName);
-			
-				OSErr err = FSOpenFork(	&fileRef,
-										dataForkName.length,
-										dataForkName.unicode,
-										fsRdPerm,
-										&refNum);
+				result = imBadFile;
 			}
-										
-			CFRelease(filePathURL);
-		}
-									
-		CFRelease(filePathCFSR);
-
-		if(CAST_FILEREF(refNum) != imInvalidHandleValue)
-		{
-			SDKfileOpenRec8->fileinfo.fileref = *SDKfileRef = CAST_FILEREF(refNum);
+			else
+				localRecP->links = LinkTable::build(&vf);
 		}
 		else
-			result = imFileOpenFailed;
-	#endif
-
+			result = imBadHeader;
 	}
-
-	if(result == malNoError)
+	else if(localRecP->fileType == Opus_filetype)
 	{
-		localRecP->fileType = SDKfileOpenRec8->fileinfo.filetype;
+		int _error = 0;
 		
-		assert(0 == ogg_tell_func(static_cast<void *>(*SDKfileRef)));
-			
-		if(localRecP->fileType == Ogg_filetype)
-		{
-			localRecP->vf = new OggVorbis_File;
+		const unsigned char *data = localRecP->source->get_data();
 		
-			OggVorbis_File &vf = *localRecP->vf;
-			
-			int ogg_err = ov_open_callbacks(static_cast<void *>(*SDKfileRef), &vf, NULL, 0, g_ov_callbacks);
-			
-			if(ogg_err == OV_OK)
-			{
-				if( ov_streams(&vf) == 0 )
-				{
-					result = imFileHasNoImportableStreams;
-					
-					ov_clear(&vf);
-				}
-				else if( !ov_seekable(&vf) )
-				{
-					result = imBadFile;
-				}
-			}
-			else
-				result = imBadHeader;
-		}
-		else if(localRecP->fileType == Opus_filetype)
+		localRecP->opusMemory = (data != NULL);
+		
+		if(data != NULL)
+			localRecP->opus = op_open_memory(data, localRecP->source->get_size(), &_error);
+		else
+			localRecP->opus = op_open_callbacks(static_cast<void *>(localRecP->stream), &g_opusfile_callbacks, NULL, 0, &_error);
+		
+		if(localRecP->opus != NULL && _error == 0)
 		{
-			int _error = 0;
-			
-			localRecP->opus = op_open_callbacks(static_cast<void *>(*SDKfileRef), &g_opusfile_callbacks, NULL, 0, &_error);
+			localRecP->links = LinkTable::build(localRecP->opus);
 			
-			if(localRecP->opus != NULL && _error == 0)
-			{
-				assert(op_link_count(localRecP->opus) == 1); // we're not really handling multi-link scenarios
-			}
-			else
-				result = imBadHeader;
-		}
-		else if(localRecP->fileType == FLAC_filetype)
-		{
-			try
+			if( get_setting(SETTING_FAST_PREVIEW, 0) )
 			{
-				localRecP->flac = new OurDecoder(*SDKfileRef);
+				localRecP->opusPreview = new OpusPreview;
 				
-				localRecP->flac->set_md5_checking(true);
+				localRecP->opusPreview->opus = localRecP->opus;
+				localRecP->opusPreview->enabled = false;
+				localRecP->opusPreview->decoder = NULL;
+				localRecP->opusPreview->link = -1;
 				
-				FLAC__StreamDecoderInitStatus init_status = localRecP->flac->init();
+				reset_opus_preview(localRecP->opusPreview);
 				
-				assert(init_status == FLAC__STREAM_DECODER_INIT_STATUS_OK && localRecP->flac->is_valid());
-				
-				bool ok = localRecP->flac->process_until_end_of_metadata();
-				
-				assert(ok);
-			}
-			catch(...)
-			{
-				result = imBadHeader;
+				op_set_decode_callback(localRecP->opus, opus_preview_decode, localRecP->opusPreview);
 			}
 		}
+		else
+			result = imBadHeader;
 	}
-	
-	// close file and delete private data if we got a bad file
-	if(result != malNoError)
+	else if(localRecP->fileType == FLAC_filetype)
 	{
-		if(SDKfileOpenRec8->privatedata)
+		try
 		{
-			stdParms->piSuites->memFuncs->disposeHandle(reinterpret_cast<PrMemoryHandle>(SDKfileOpenRec8->privatedata));
-			SDKfileOpenRec8->privatedata = NULL;
+			localRecP->flac = new OurDecoder(localRecP->stream);
+			
+			localRecP->flac->set_md5_checking(true);
+			
+			localRecP->flac->set_metadata_respond(FLAC__METADATA_TYPE_SEEKTABLE);
+			
+			FLAC__StreamDecoderInitStatus init_status = localRecP->flac->init();
+			
+			assert(init_status == FLAC__STREAM_DECODER_INIT_STATUS_OK && localRecP->flac->is_valid());
+			
+			bool ok = localRecP->flac->process_until_end_of_metadata();
+			
+			assert(ok);
+		}
+		catch(...)
+		{
+			result = imBadHeader;
 		}
-	}
-	else
-	{
-		stdParms->piSuites->memFuncs->unlockHandle(reinterpret_cast<char**>(SDKfileOpenRec8->privatedata));
 	}
 
+	if(result == malNoError)
+		localRecP->pcmPosition = 0; // fresh decoders start at the beginning
+	
 	return result;
 }
 
 
+// ...or on an open file
+static prMALError
+open_decoder(ImporterLocalRec8Ptr localRecP, imFileRef fp, const prUTF16Char *path)
+{
+	return open_decoder(localRecP, create_source(fp, path));
+}
 
-static prMALError 
-SDKQuietFile(
-	imStdParms			*stdParms, 
-	imFileRef			*SDKfileRef, 
-	void				*privateData)
+
+// Undoes open_decoder, except for the file itself
+static void
+close_decoder(ImporterLocalRec8Ptr localRecP)
 {
-	// "Quiet File" really means close the file handle, but we're still
-	// using it and might open it again, so hold on to any stored data
-	// structures you don't want to re-create.
+	if(localRecP->vf)
+	{
+		int clear_err = ov_clear(localRecP->vf);
+		
+		assert(clear_err == OV_OK);
+		
+		delete localRecP->vf;
+		
+		localRecP->vf = NULL;
+	}
 
-	// If file has not yet been closed
-	if(SDKfileRef && *SDKfileRef != imInvalidHandleValue)
+	if(localRecP->opus)
 	{
-		ImporterLocalRec8H ldataH	= reinterpret_cast<ImporterLocalRec8H>(privateData);
+		op_free(localRecP->opus);
+		
+		localRecP->opus = NULL;
+		localRecP->opusMemory = false;
+	}
+	
+	if(localRecP->opusPreview)
+	{
+		if(localRecP->opusPreview->decoder != NULL)
+			opus_multistream_decoder_destroy(localRecP->opusPreview->decoder);
+		
+		delete localRecP->opusPreview;
+		
+		localRecP->opusPreview = NULL;
+	}
+	
+	if(localRecP->opusWindow)
+	{
+		aligned_free(localRecP->opusWindow);
+		
+		localRecP->opusWindow = NULL;
+	}
+
+	if(localRecP->flac)
+	{
+		localRecP->flac->finish();
+		
+		delete localRecP->flac;
+		
+		localRecP->flac = NULL;
+	}
+	
+	if(localRecP->links)
+	{
+		delete localRecP->links;
+		
+		localRecP->links = NULL;
+	}
+	
+	localRecP->pcmPosition = -1;
+	
+	if(localRecP->stream)
+	{
+		delete localRecP->stream;
+		
+		localRecP->stream = NULL;
+	}
+	
+	if(localRecP->source)
+	{
+		delete localRecP->source;
+		
+		localRecP->source = NULL;
+	}
+}
+
+
+// Premiere quiets files all the time in big projects, and opening the decoder again means
+// parsing the headers and hunting down the end of the file, which libvorbisfile and
+// opusfile won't skip.  So when the file gets closed, the decoder is put aside with
+// everything it parsed, minus its source.  A big project could quiet hundreds of clips,
+// so only the most recent few are kept, for all the clips together.  Each one is held
+// in an ImporterLocalRec8 of its own, and the clip keeps a ticket to claim it with.
+typedef struct
+{
+	unsigned int		ticket;
+	ImporterLocalRec8	*rec;
+} ParkedDecoder;
+
+static Mutex g_parked_mutex;
+static std::list<ParkedDecoder> g_parked; // oldest first
+static unsigned int g_last_ticket = 0;
+
+
+// Hand the decoder, and what goes with it, from one ImporterLocalRec8 to another
+static void
+move_decoder(ImporterLocalRec8Ptr from, ImporterLocalRec8Ptr to)
+{
+	to->stream = from->stream;
+	to->vf = from->vf;
+	to->opus = from->opus;
+	to->opusMemory = from->opusMemory;
+	to->flac = from->flac;
+	to->links = from->links;
+	to->opusPreview = from->opusPreview;
+	to->pcmPosition = from->pcmPosition;
+	
+	from->stream = NULL;
+	from->vf = NULL;
+	from->opus = NULL;
+	from->opusMemory = false;
+	from->flac = NULL;
+	from->links = NULL;
+	from->opusPreview = NULL;
+	from->pcmPosition = -1;
+}
+
+
+// Returns false if the decoder had to go
+static bool
+park_decoder(ImporterLocalRec8Ptr localRecP)
+{
+	const bool have_decoder = (localRecP->vf != NULL || localRecP->opus != NULL || localRecP->flac != NULL);
+	
+	// op_open_memory() reads the file's memory directly, so that one can't let go of it
+	const bool opus_memory = (localRecP->opus != NULL && localRecP->opusMemory);
+	
+	const int max_parked = get_setting(SETTING_WARM_REOPEN, 16);
+	
+	if(!have_decoder || localRecP->stream == NULL || localRecP->filePath == NULL ||
+		opus_memory || max_parked <= 0)
+	{
+		close_decoder(localRecP);
+		
+		return false;
+	}
+	
+	localRecP->stream->set_source(NULL);
+	
+	if(localRecP->source)
+	{
+		delete localRecP->source;
+		
+		localRecP->source = NULL;
+	}
+	
+	// easy enough to make again
+	if(localRecP->opusWindow)
+	{
+		aligned_free(localRecP->opusWindow);
+		
+		localRecP->opusWindow = NULL;
+	}
+	
+	ParkedDecoder parked;
+	
+	parked.rec = new ImporterLocalRec8;
+	
+	memset(parked.rec, 0, sizeof(ImporterLocalRec8));
+	
+	move_decoder(localRecP, parked.rec);
+	
+	ScopedLock lock(g_parked_mutex);
+	
+	if(++g_last_ticket == 0)
+		g_last_ticket++; // 0 means no ticket
+	
+	parked.ticket = localRecP->parkedTicket = g_last_ticket;
+	
+	g_parked.push_back(parked);
+	
+	while((int)g_parked.size() > max_parked)
+	{
+		// its clip will find its ticket doesn't work anymore and open a new one
+		close_decoder(g_parked.front().rec);
+		
+		delete g_parked.front().rec;
+		
+		g_parked.pop_front();
+	}
+	
+	return true;
+}
+
+
+// Get the clip's decoder back, false if it wasn't kept.  The caller gives it its file.
+static bool
+claim_parked_decoder(ImporterLocalRec8Ptr localRecP)
+{
+	bool found = false;
+	
+	if(localRecP->parkedTicket != 0)
+	{
+		ScopedLock lock(g_parked_mutex);
+		
+		for(std::list<ParkedDecoder>::iterator i = g_parked.begin(); i != g_parked.end() && !found; ++i)
+		{
+			if(i->ticket == localRecP->parkedTicket)
+			{
+				move_decoder(i->rec, localRecP);
+				
+				delete i->rec;
+				
+				g_parked.erase(i);
+				
+				found = true;
+			}
+		}
+		
+		localRecP->parkedTicket = 0;
+	}
+	
+	return found;
+}
+
+
+// The clip is going away or changed, so we don't want its decoder after all
+static void
+drop_parked_decoder(ImporterLocalRec8Ptr localRecP)
+{
+	if( claim_parked_decoder(localRecP) )
+		close_decoder(localRecP);
+}
+
+
+// Ask the open decoder about the clip
+static prMALError
+get_decoder_info(ImporterLocalRec8Ptr localRecP, ClipInfo *info)
+{
+	prMALError result = malNoError;
+	
+	if(localRecP->fileType == Ogg_filetype && localRecP->vf != NULL)
+	{
+		OggVorbis_File &vf = *localRecP->vf;
+	
+		vorbis_info *vinfo = ov_info(&vf, 0);
+	
+		// a chained file gets the most channels any link has, the rest get converted
+		info->channels = (localRecP->links != NULL ? localRecP->links->max_channels() : vinfo->channels);
+		info->sampleRate = vinfo->rate;
+		info->bitsPerSample = 0;
+		info->duration = ov_pcm_total(&vf, -1);
+	}
+	else if(localRecP->fileType == Opus_filetype && localRecP->opus != NULL)
+	{
+		info->channels = (localRecP->links != NULL ? localRecP->links->max_channels() : op_channel_count(localRecP->opus, -1));
+		info->sampleRate = 48000; // Ogg Opus always uses 48 kHz
+		info->bitsPerSample = 0;
+		info->duration = op_pcm_total(localRecP->opus, -1);
+	}
+	else if(localRecP->fileType == FLAC_filetype && localRecP->flac != NULL)
+	{
+		try
+		{
+			info->channels = localRecP->flac->get_channels();
+			info->sampleRate = localRecP->flac->get_sample_rate();
+			info->bitsPerSample = localRecP->flac->get_bits_per_sample();
+			info->duration = localRecP->flac->get_total_samples();
+		}
+		catch(...)
+		{
+			result = imBadFile;
+		}
+	}
+	else
+		result = imBadFile;
+	
+	return result;
+}
+
+
+// For bulk imports, setting up the decoder for every clip takes far longer than finding
+// the files.  Instead, we can get what imGetInfo8 needs from the first header and the last
+// page, and leave the decoder for the first audio request.  The Ogg duration is the last
+// granule position, which is right for anything that isn't chained or starts late.
+enum {
+	PROBE_HEAD	= 4096,			// the ID header is all alone on the first page
+	PROBE_TAIL	= 64 * 1024		// the last page is in here, unless something's strange
+};
+
+
+static bool
+probe_ogg_info(imFileRef fp, ogg_int64_t size, bool opus, ClipInfo *info)
+{
+	unsigned char head[PROBE_HEAD];
+	size_t head_len = 0;
+	
+	if(!read_file(fp, 0, head, PROBE_HEAD, &head_len) || head_len < 27 + 1 + 19)
+		return false;
+	
+	if(memcmp(head, "OggS", 4) != 0 || head[4] != 0 || !(head[5] & 0x02)) // has to be the first page
+		return false;
+	
+	const ogg_uint32_t serial = read_le32(&head[14]);
+	
+	const size_t body = 27 + head[26];
+	
+	if(body + 19 > head_len)
+		return false;
+	
+	const unsigned char *packet = &head[body];
+	
+	int pre_skip = 0;
+	
+	if(opus)
+	{
+		if(memcmp(packet, "OpusHead", 8) != 0)
+			return false;
+		
+		info->channels = packet[9];
+		info->sampleRate = 48000;
+		
+		pre_skip = packet[10] | (packet[11] << 8);
+	}
+	else
+	{
+		if(packet[0] != 0x01 || memcmp(&packet[1], "vorbis", 6) != 0 || body + 30 > head_len)
+			return false;
+		
+		info->channels = packet[11];
+		info->sampleRate = read_le32(&packet[12]);
+	}
+	
+	info->bitsPerSample = 0;
+	
+	
+	// now find the last page with a granule position that goes with this stream
+	std::vector<unsigned char> tail( (size_t)(size < PROBE_TAIL ? size : (ogg_int64_t)PROBE_TAIL) );
+	
+	const ogg_int64_t tail_offset = size - tail.size();
+	
+	size_t tail_len = 0;
+	
+	if(tail.size() < 27 || !read_file(fp, tail_offset, &tail[0], tail.size(), &tail_len) || tail_len != tail.size())
+		return false;
+	
+	for(ogg_int64_t i = (ogg_int64_t)tail_len - 27; i >= 0; i--)
+	{
+		const unsigned char *page = &tail[(size_t)i];
+		
+		if(page[0] != 'O' || memcmp(page, "OggS", 4) != 0 || page[4] != 0 || read_le32(&page[14]) != serial)
+			continue;
+		
+		const ogg_int64_t granule = read_le64(&page[6]);
+		
+		if(granule == -1)
+			continue;
+		
+		// "OggS" could turn up inside a packet, so the page has to fit in the file
+		if(i + 27 + page[26] > (ogg_int64_t)tail_len)
+			continue;
+		
+		ogg_int64_t page_len = 27 + page[26];
+		
+		for(int s=0; s < page[26]; s++)
+			page_len += page[27 + s];
+		
+		if(tail_offset + i + page_len > size)
+			continue;
+		
+		info->duration = granule - pre_skip;
+		
+		return (info->channels > 0 && info->sampleRate > 0 && info->duration > 0);
+	}
+	
+	return false;
+}
+
+
+static bool
+probe_flac_info(imFileRef fp, ClipInfo *info)
+{
+	unsigned char head[10 + 4 + 4 + 34];
+	size_t head_len = 0;
+	
+	if(!read_file(fp, 0, head, 10, &head_len) || head_len != 10)
+		return false;
+	
+	const ogg_int64_t offset = flac_start(head);
+	
+	// "fLaC", then a metadata block header, and STREAMINFO always comes first
+	if(!read_file(fp, offset, head, 4 + 4 + 34, &head_len) || head_len != 4 + 4 + 34)
+		return false;
+	
+	if(memcmp(head, "fLaC", 4) != 0 || (head[4] & 0x7f) != FLAC__METADATA_TYPE_STREAMINFO)
+		return false;
+	
+	const unsigned char *si = &head[8];
+	
+	info->sampleRate = (si[10] << 12) | (si[11] << 4) | (si[12] >> 4);
+	info->channels = ((si[12] >> 1) & 0x07) + 1;
+	info->bitsPerSample = (((si[12] & 0x01) << 4) | (si[13] >> 4)) + 1;
+	info->duration = ((ogg_int64_t)(si[13] & 0x0f) << 32) |
+						((ogg_uint32_t)si[14] << 24) | (si[15] << 16) | (si[16] << 8) | si[17];
+	
+	// if the encoder didn't know the length, we'll have to ask libFLAC to find it
+	return (info->sampleRate > 0 && info->duration > 0);
+}
+
+
+// What the headers say about the clip, without opening the decoder
+static bool
+probe_clip_info(imFileRef fp, csSDK_int32 fileType, ClipInfo *info)
+{
+	const ogg_int64_t size = file_size(fp);
+	
+	if(size <= 0)
+		return false;
+	
+	if(fileType == FLAC_filetype)
+		return probe_flac_info(fp, info);
+	else
+		return probe_ogg_info(fp, size, (fileType == Opus_filetype), info);
+}
+
+
+// Load the clip's seek index from the disk cache, or start making one.  When all the
+// builders are busy, we ask again with the next audio request.
+static void
+attach_seek_index(ImporterLocalRec8Ptr localRecP)
+{
+	if(localRecP->seekIndex != NULL || localRecP->indexBuilder != NULL || localRecP->indexFailed ||
+		localRecP->source == NULL || !get_setting(SETTING_SEEK_INDEX, 1))
+		return;
+	
+	const bool flac = (localRecP->fileType == FLAC_filetype);
+	
+	// libFLAC can seek quickly enough with a decent SEEKTABLE
+	if(flac && localRecP->flac != NULL && localRecP->flac->has_seek_table())
+		return;
+	
+	// scan_ogg() gives up on chained files, so don't start it every time
+	if(localRecP->links != NULL && localRecP->links->count() > 1)
+		return;
+	
+	// one point a second or so, Opus granules always count at 48k
+	const ogg_int64_t spacing = (localRecP->fileType == Opus_filetype ? 48000 :
+									localRecP->info.sampleRate > 0 ? localRecP->info.sampleRate : 48000);
+	
+	if(localRecP->source->get_data() != NULL)
+	{
+		// clips in memory are quick to scan and not worth a file
+		localRecP->seekIndex = (flac ? SeekIndex::scan_flac(localRecP->source, spacing, NULL) :
+										SeekIndex::scan_ogg(localRecP->source, spacing, NULL));
+		
+		localRecP->indexFailed = (localRecP->seekIndex == NULL);
+	}
+	else if(localRecP->identity.size > 0 && localRecP->filePath != NULL)
+	{
+		const PathString dir = disk_cache_dir();
+		
+		const PathString path = (dir.empty() ? PathString() : disk_cache_path(dir, localRecP->identity, "index"));
+		
+		// another instance with the same clip might have just saved it
+		if( !path.empty() )
+			localRecP->seekIndex = SeekIndex::load(path, localRecP->identity);
+		
+		if(localRecP->seekIndex == NULL)
+		{
+			// the libraries can do the seeking while this runs
+			localRecP->indexBuilder = IndexBuilder::create(localRecP->filePath, localRecP->identity,
+															flac, spacing, path, localRecP->partialIndex);
+			
+			if(localRecP->indexBuilder != NULL)
+				localRecP->partialIndex = NULL; // the builder has it now
+		}
+		else if(localRecP->partialIndex != NULL)
+		{
+			delete localRecP->partialIndex;
+			
+			localRecP->partialIndex = NULL;
+		}
+	}
+}
+
+
+// Pick up the index once the background scan is done, or start the scan if it's
+// been waiting for a builder.  Stopping a scan that's still going (the file is being
+// quieted) keeps what it's done, so the next one can carry on from there.
+static void
+adopt_seek_index(ImporterLocalRec8Ptr localRecP, bool stop = false)
+{
+	if(localRecP->indexBuilder != NULL)
+	{
+		if(stop)
+		{
+			localRecP->indexBuilder->cancel();
+			
+			localRecP->indexBuilder->join();
+		}
+		else if( !localRecP->indexBuilder->finished() )
+			return;
+		
+		assert(localRecP->seekIndex == NULL && localRecP->partialIndex == NULL);
+		
+		localRecP->seekIndex = localRecP->indexBuilder->take_index(&localRecP->partialIndex);
+		
+		localRecP->indexFailed = (localRecP->seekIndex == NULL && localRecP->partialIndex == NULL);
+		
+		delete localRecP->indexBuilder;
+		
+		localRecP->indexBuilder = NULL;
+	}
+	else if(!stop)
+		attach_seek_index(localRecP);
+}
+
+
+// Give a parked decoder its file back.  It picks up right where it was.
+static void
+unpark_decoder(ImporterLocalRec8Ptr localRecP, imFileRef fp)
+{
+	assert(localRecP->source == NULL && localRecP->stream != NULL);
+	
+	localRecP->source = create_source(fp, localRecP->filePath);
+	
+	localRecP->stream->set_source(localRecP->source);
+	
+	attach_seek_index(localRecP);
+}
+
+
+// Small clips go into memory on the first audio request, not when they're opened or
+// unparked, so importing a project or coming back from imQuietFile doesn't read every
+// clip in full.  Only call this while nothing else can be using the clip's decoder.
+static void
+load_into_memory(ImporterLocalRec8Ptr localRecP, imFileRef fp)
+{
+	if(localRecP->source == NULL || localRecP->stream == NULL || localRecP->source->get_data() != NULL)
+		return;
+	
+	FileSource *memory = load_source(fp);
+	
+	if(memory != NULL)
+	{
+		localRecP->stream->set_source(memory);
+		
+		delete localRecP->source;
+		
+		localRecP->source = memory;
+	}
+}
+
+
+// When we got the clip info from the disk cache, we haven't opened the decoder yet.
+// After imQuietFile, it might be parked.
+static prMALError
+ensure_decoder(ImporterLocalRec8Ptr localRecP, imFileRef fp)
+{
+	const bool have_decoder = (localRecP->vf != NULL || localRecP->opus != NULL || localRecP->flac != NULL);
+	
+	if(have_decoder)
+		return malNoError;
+	
+	if(fp == imInvalidHandleValue || localRecP->filePath == NULL)
+		return imFileOpenFailed;
+	
+	if( claim_parked_decoder(localRecP) )
+	{
+		unpark_decoder(localRecP, fp);
+		
+		return malNoError;
+	}
+	
+	prMALError result = open_decoder(localRecP, fp, localRecP->filePath);
+	
+	if(result == malNoError && localRecP->infoProbed)
+	{
+		// Now we know for sure.  Premiere already has the probed duration, and will
+		// just get silence past the real end (or lose the last bit) until it asks again.
+		ClipInfo info;
+		
+		result = get_decoder_info(localRecP, &info);
+		
+		if(result == malNoError)
+		{
+			if(info.channels != localRecP->info.channels || info.sampleRate != localRecP->info.sampleRate)
+			{
+				result = imBadHeader; // the first header was lying to us, somehow
+			}
+			else
+			{
+				localRecP->info = info;
+				localRecP->infoProbed = false;
+				
+				write_clip_info(localRecP->identity, localRecP->fileType, localRecP->info);
+			}
+		}
+	}
+	
+	if(result == malNoError)
+		attach_seek_index(localRecP);
+	else
+		close_decoder(localRecP);
+	
+	return result;
+}
+
+
+// When requests for the same clip come from different places (a few tracks, a nested
+// sequence, a render going on during playback), one decoder would spend all its time
+// seeking back and forth.  So a clip gets a few, each with its own place in the file,
+// and a request goes to whichever one is closest.  Another one only gets opened when
+// they're all busy, and when we can't have any more, a request waits for one to free up.
+class DecoderPool
+{
+  public:
+	DecoderPool(int max_decoders) : _max_decoders(max_decoders), _can_open(true), _opening(0),
+									_main_busy(false), _main_used(0), _clock(0) {}
+	~DecoderPool();
+	
+	// The decoder to use, either the clip's own (localRecP) or one of ours.
+	// Nobody else gets it until you call release() with it.  Without wait,
+	// NULL if they're all busy and we can't open another.
+	ImporterLocalRec8Ptr acquire(ImporterLocalRec8Ptr localRecP, ogg_int64_t position, bool wait = true);
+	void release(ImporterLocalRec8Ptr decoderRecP);
+	
+	int max_decoders() const { return _max_decoders; }
+	
+  private:
+	typedef struct {
+		ImporterLocalRec8	*rec;
+		imFileRef			fp; // invalid if we're sharing the clip in memory
+		bool				busy;
+		unsigned int		last_used;
+	} Decoder;
+	
+	static ogg_uint64_t distance(const ImporterLocalRec8 *rec, ogg_int64_t position);
+	
+	bool open(ImporterLocalRec8Ptr localRecP, Decoder *decoder);
+	
+	static void close(Decoder &decoder);
+	
+	const int _max_decoders; // counting the clip's own
+	
+	Mutex _mutex;
+	Event _released;
+	
+	bool _can_open; // until opening one fails
+	int _opening; // decoders being opened right now
+	
+	bool _main_busy;
+	unsigned int _main_used;
+	
+	std::vector<Decoder> _decoders;
+	
+	unsigned int _clock;
+};
+
+
+DecoderPool::~DecoderPool()
+{
+	assert(!_main_busy && _opening == 0);
+	
+	for(size_t i=0; i < _decoders.size(); i++)
+	{
+		assert(!_decoders[i].busy);
+		
+		close(_decoders[i]);
+	}
+}
+
+
+ogg_uint64_t
+DecoderPool::distance(const ImporterLocalRec8 *rec, ogg_int64_t position)
+{
+	if(rec->pcmPosition < 0)
+		return (ogg_uint64_t)-1;
+	
+	return (position >= rec->pcmPosition ? position - rec->pcmPosition : rec->pcmPosition - position);
+}
+
+
+ImporterLocalRec8Ptr
+DecoderPool::acquire(ImporterLocalRec8Ptr localRecP, ogg_int64_t position, bool wait)
+{
+	while(true)
+	{
+		bool try_open = false;
+		
+		{
+			ScopedLock lock(_mutex);
+			
+			_clock++;
+			
+			ImporterLocalRec8Ptr best = NULL;
+			ogg_uint64_t best_distance = (ogg_uint64_t)-1;
+			unsigned int best_used = 0;
+			
+			Decoder *best_decoder = NULL;
+			
+			int idle = 0;
+			
+			if(!_main_busy)
+			{
+				best = localRecP;
+				best_distance = distance(localRecP, position);
+				best_used = _main_used;
+				
+				idle++;
+			}
+			
+			for(size_t i=0; i < _decoders.size(); i++)
+			{
+				Decoder &decoder = _decoders[i];
+				
+				if(!decoder.busy)
+				{
+					const ogg_uint64_t dist = distance(decoder.rec, position);
+					
+					// on a tie, go with the one that's been sitting around longest
+					if(best == NULL || dist < best_distance || (dist == best_distance && decoder.last_used < best_used))
+					{
+						best = decoder.rec;
+						best_distance = dist;
+						best_used = decoder.last_used;
+						best_decoder = &decoder;
+					}
+					
+					idle++;
+				}
+			}
+			
+			if(best != NULL)
+			{
+				if(best_decoder != NULL)
+				{
+					best_decoder->busy = true;
+					best_decoder->last_used = _clock;
+					
+					best->seekIndex = localRecP->seekIndex; // might have shown up since last time
+				}
+				else
+				{
+					_main_busy = true;
+					_main_used = _clock;
+				}
+				
+				// one signal can stand for more than one release, so pass it on
+				if(idle > 1)
+					_released.signal();
+				
+				return best;
+			}
+			
+			// they're all busy, so start another one if we're allowed
+			if(_can_open && (int)_decoders.size() + _opening + 1 < _max_decoders)
+			{
+				_opening++;
+				
+				try_open = true;
+			}
+		}
+		
+		if(try_open)
+		{
+			// opening can take a while, no reason to hold everyone else up
+			Decoder decoder;
+			
+			const bool opened = open(localRecP, &decoder);
+			
+			ScopedLock lock(_mutex);
+			
+			_opening--;
+			
+			if(opened)
+			{
+				decoder.busy = true;
+				decoder.last_used = _clock;
+				
+				_decoders.push_back(decoder);
+				
+				return decoder.rec;
+			}
+			
+			_can_open = false; // probably out of file handles, stick with what we have
+		}
+		else if(!wait)
+			return NULL;
+		else
+			_released.wait();
+	}
+}
+
+
+void
+DecoderPool::release(ImporterLocalRec8Ptr decoderRecP)
+{
+	{
+		ScopedLock lock(_mutex);
+		
+		bool found = false;
+		
+		for(size_t i=0; i < _decoders.size() && !found; i++)
+		{
+			if(_decoders[i].rec == decoderRecP)
+			{
+				_decoders[i].busy = false;
+				
+				found = true;
+			}
+		}
+		
+		if(!found)
+			_main_busy = false;
+	}
+	
+	_released.signal();
+}
+
+
+// Another decoder on the same clip, with its own file handle (or the same memory)
+bool
+DecoderPool::open(ImporterLocalRec8Ptr localRecP, Decoder *decoder)
+{
+	if(localRecP->source == NULL || (localRecP->source->get_data() == NULL && localRecP->filePath == NULL))
+		return false;
+	
+	ImporterLocalRec8 *rec = new ImporterLocalRec8;
+	
+	memset(rec, 0, sizeof(ImporterLocalRec8));
+	
+	rec->importerID = localRecP->importerID;
+	rec->fileType = localRecP->fileType;
+	rec->numChannels = localRecP->numChannels;
+	rec->audioSampleRate = localRecP->audioSampleRate;
+	rec->identity = localRecP->identity;
+	rec->info = localRecP->info;
+	rec->seekIndex = localRecP->seekIndex; // just borrowing these two
+	rec->filePath = localRecP->filePath;
+	rec->pcmPosition = -1;
+	
+	imFileRef fp = imInvalidHandleValue;
+	
+	FileSource *source = NULL;
+	
+	if(localRecP->source->get_data() != NULL)
+	{
+		source = new SharedSource(localRecP->source);
+	}
+	else
+	{
+		fp = open_file(localRecP->filePath);
+		
+		if(fp != imInvalidHandleValue)
+			source = new BlockCache(fp);
+	}
+	
+	bool ok = (source != NULL && open_decoder(rec, source) == malNoError);
+	
+	if(!ok)
+	{
+		close_decoder(rec);
+		
+		delete rec;
+		
+		if(fp != imInvalidHandleValue)
+			close_file(fp);
+		
+		return false;
+	}
+	
+	decoder->rec = rec;
+	decoder->fp = fp;
+	decoder->busy = false;
+	decoder->last_used = 0;
+	
+	return true;
+}
+
+
+void
+DecoderPool::close(Decoder &decoder)
+{
+	close_decoder(decoder.rec);
+	
+	if(decoder.rec->blockBuffer != NULL)
+		free(decoder.rec->blockBuffer);
+	
+	delete decoder.rec;
+	
+	decoder.rec = NULL;
+	
+	if(decoder.fp != imInvalidHandleValue)
+		close_file(decoder.fp);
+	
+	decoder.fp = imInvalidHandleValue;
+}
+
+
+static prMALError 
+SDKQuietFile(
+	imStdParms			*stdParms, 
+	imFileRef			*SDKfileRef, 
+	void				*privateData);
+
+
+// Everything SDKQuietFile holds on to, for when the clip is gone for good
+static void
+free_clip(ImporterLocalRec8Ptr localRecP)
+{
+	close_decoder(localRecP); // not parked, this is goodbye
+	
+	drop_parked_decoder(localRecP);
+	
+	if(localRecP->blockBuffer)
+	{
+		free(localRecP->blockBuffer);
+		
+		localRecP->blockBuffer = NULL;
+	}
+	
+	if(localRecP->conformed)
+	{
+		delete localRecP->conformed;
+		
+		localRecP->conformed = NULL;
+	}
+	
+	if(localRecP->seekIndex)
+	{
+		delete localRecP->seekIndex;
+		
+		localRecP->seekIndex = NULL;
+	}
+	
+	if(localRecP->partialIndex)
+	{
+		delete localRecP->partialIndex;
+		
+		localRecP->partialIndex = NULL;
+	}
+	
+	if(localRecP->filePath)
+	{
+		free(localRecP->filePath);
+		
+		localRecP->filePath = NULL;
+	}
+	
+	delete localRecP->clipMutex;
+	
+	localRecP->clipMutex = NULL;
+}
+
+
+prMALError 
+SDKOpenFile8(
+	imStdParms		*stdParms, 
+	imFileRef		*SDKfileRef, 
+	imFileOpenRec8	*SDKfileOpenRec8)
+{
+	prMALError			result = malNoError;
+
+	ImporterLocalRec8H	localRecH = NULL;
+	ImporterLocalRec8Ptr localRecP = NULL;
+
+	if(SDKfileOpenRec8->privatedata)
+	{
+		localRecH = (ImporterLocalRec8H)SDKfileOpenRec8->privatedata;
+
+		stdParms->piSuites->memFuncs->lockHandle(reinterpret_cast<char**>(localRecH));
+
+		localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *localRecH );
+	}
+	else
+	{
+		localRecH = (ImporterLocalRec8H)stdParms->piSuites->memFuncs->newHandle(sizeof(ImporterLocalRec8));
+		SDKfileOpenRec8->privatedata = (PrivateDataPtr)localRecH;
+
+		stdParms->piSuites->memFuncs->lockHandle(reinterpret_cast<char**>(localRecH));
+
+		localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *localRecH );
+		
+		localRecP->source = NULL;
+		localRecP->stream = NULL;
+		
+		localRecP->vf = NULL;
+		localRecP->opus = NULL;
+		localRecP->opusMemory = false;
+		localRecP->flac = NULL;
+		localRecP->links = NULL;
+		
+		localRecP->pcmPosition = -1;
+		for(int i=0; i < REQUEST_STREAMS; i++)
+			localRecP->requestEnds[i] = 0;
+		
+		localRecP->lastRequest = 0;
+		localRecP->scrubJumps = 0;
+		
+		localRecP->blockBuffer = NULL;
+		localRecP->opusWindow = NULL;
+		
+		memset(&localRecP->identity, 0, sizeof(FileIdentity));
+		localRecP->haveInfo = false;
+		localRecP->infoProbed = false;
+		localRecP->seekIndex = NULL;
+		localRecP->indexBuilder = NULL;
+		localRecP->partialIndex = NULL;
+		localRecP->indexFailed = false;
+		
+		localRecP->filePath = NULL;
+		localRecP->conformed = NULL;
+		localRecP->diskBuilder = NULL;
+		localRecP->diskCacheFailed = false;
+		localRecP->decoderPool = NULL;
+		localRecP->readAhead = NULL;
+		localRecP->opusPreview = NULL;
+		localRecP->parkedTicket = 0;
+		localRecP->clipMutex = new Mutex;
+		
+		localRecP->importerID = SDKfileOpenRec8->inImporterID;
+		localRecP->fileType = SDKfileOpenRec8->fileinfo.filetype;
+	}
+
+
+	SDKfileOpenRec8->fileinfo.fileref = *SDKfileRef = reinterpret_cast<imFileRef>(imInvalidHandleValue);
+
+
+	if(localRecP)
+	{
+		imFileRef fp = open_file(SDKfileOpenRec8->fileinfo.filepath);
+		
+		if(fp != imInvalidHandleValue)
+		{
+			SDKfileOpenRec8->fileinfo.fileref = *SDKfileRef = fp;
+		}
+		else
+			result = imFileOpenFailed;
+	}
+
+	if(result == malNoError)
+	{
+		localRecP->fileType = SDKfileOpenRec8->fileinfo.filetype;
+		
+		const FileIdentity old_identity = localRecP->identity;
+		
+		if( !get_file_identity(*SDKfileRef, SDKfileOpenRec8->fileinfo.filepath, &localRecP->identity) )
+			memset(&localRecP->identity, 0, sizeof(FileIdentity)); // size 0 keeps us out of the cache
+		
+		// if the file changed while we were quiet, what we had is for the old one
+		// (and if we can't tell, we have to assume it did)
+		if( !(localRecP->identity == old_identity) || localRecP->identity.size == 0 )
+		{
+			close_decoder(localRecP);
+			
+			drop_parked_decoder(localRecP);
+			
+			localRecP->haveInfo = false;
+			localRecP->infoProbed = false;
+			
+			if(localRecP->conformed)
+			{
+				delete localRecP->conformed;
+				
+				localRecP->conformed = NULL;
+			}
+			
+			localRecP->diskCacheFailed = false;
+			
+			if(localRecP->seekIndex)
+			{
+				delete localRecP->seekIndex;
+				
+				localRecP->seekIndex = NULL;
+			}
+			
+			if(localRecP->partialIndex)
+			{
+				delete localRecP->partialIndex;
+				
+				localRecP->partialIndex = NULL;
+			}
+			
+			localRecP->indexFailed = false;
+		}
+		
+		if(localRecP->filePath == NULL)
+		{
+			size_t path_len = 0;
+			
+			while(SDKfileOpenRec8->fileinfo.filepath[path_len] != 0)
+				path_len++;
+			
+			localRecP->filePath = (prUTF16Char *)malloc(sizeof(prUTF16Char) * (path_len + 1));
+			
+			if(localRecP->filePath != NULL)
+				memcpy(localRecP->filePath, SDKfileOpenRec8->fileinfo.filepath, sizeof(prUTF16Char) * (path_len + 1));
+		}
+		
+		// If we've seen this clip before, the decoder can wait until we need audio.
+		// Coming back from imQuietFile, we still know all about it, and a parked
+		// decoder gets the file back in ensure_decoder().
+		if( !localRecP->haveInfo )
+		{
+			if( read_clip_info(localRecP->identity, localRecP->fileType, &localRecP->info) )
+			{
+				localRecP->haveInfo = true;
+			}
+			else if(get_setting(SETTING_LAZY_OPEN, 0) &&
+					probe_clip_info(*SDKfileRef, localRecP->fileType, &localRecP->info))
+			{
+				localRecP->haveInfo = true;
+				localRecP->infoProbed = true;
+			}
+			else
+			{
+				result = open_decoder(localRecP, *SDKfileRef, SDKfileOpenRec8->fileinfo.filepath);
+				
+				if(result == malNoError)
+				{
+					result = get_decoder_info(localRecP, &localRecP->info);
+					
+					if(result == malNoError)
+					{
+						localRecP->haveInfo = true;
+						
+						write_clip_info(localRecP->identity, localRecP->fileType, localRecP->info);
+						
+						attach_seek_index(localRecP);
+					}
+				}
+			}
+		}
+	}
+	
+	// close file and delete private data if we got a bad file
+	if(result != malNoError)
+	{
+		if(SDKfileOpenRec8->privatedata)
+		{
+			SDKQuietFile(stdParms, SDKfileRef, SDKfileOpenRec8->privatedata);
+			
+			free_clip(localRecP);
+			
+			stdParms->piSuites->memFuncs->disposeHandle(reinterpret_cast<PrMemoryHandle>(SDKfileOpenRec8->privatedata));
+			SDKfileOpenRec8->privatedata = NULL;
+		}
+	}
+	else
+	{
+		stdParms->piSuites->memFuncs->unlockHandle(reinterpret_cast<char**>(SDKfileOpenRec8->privatedata));
+	}
+
+	return result;
+}
+
+
+
+static prMALError 
+SDKQuietFile(
+	imStdParms			*stdParms, 
+	imFileRef			*SDKfileRef, 
+	void				*privateData)
+{
+	// "Quiet File" really means close the file handle, but we're still
+	// using it and might open it again, so hold on to any stored data
+	// structures you don't want to re-create.
+
+	// If file has not yet been closed
+	if(SDKfileRef && *SDKfileRef != imInvalidHandleValue)
+	{
+		ImporterLocalRec8H ldataH	= reinterpret_cast<ImporterLocalRec8H>(privateData);
+
+		stdParms->piSuites->memFuncs->lockHandle(reinterpret_cast<char**>(ldataH));
+
+		ImporterLocalRec8Ptr localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *ldataH );
+		
+		
+		// the builder has its own handle to the file, but that has to go too
+		if(localRecP->diskBuilder)
+		{
+			delete_disk_builder(localRecP->diskBuilder);
+			
+			localRecP->diskBuilder = NULL;
+		}
+		
+		if(localRecP->readAhead)
+		{
+			delete_read_ahead(localRecP->readAhead);
+			
+			localRecP->readAhead = NULL;
+		}
+		
+		// a scan that didn't finish carries on from there next time
+		adopt_seek_index(localRecP, true);
+		
+		if(localRecP->decoderPool)
+		{
+			delete localRecP->decoderPool;
+			
+			localRecP->decoderPool = NULL;
+		}
+		
+		park_decoder(localRecP);
+
+		stdParms->piSuites->memFuncs->unlockHandle(reinterpret_cast<char**>(ldataH));
+
+		close_file(*SDKfileRef);
+	
+		*SDKfileRef = imInvalidHandleValue;
+	}
+
+	return malNoError; 
+}
+
+
+static prMALError 
+SDKCloseFile(
+	imStdParms			*stdParms, 
+	imFileRef			*SDKfileRef,
+	void				*privateData) 
+{
+	ImporterLocalRec8H ldataH	= reinterpret_cast<ImporterLocalRec8H>(privateData);
+	
+	// If file has not yet been closed
+	if(SDKfileRef && *SDKfileRef != imInvalidHandleValue)
+	{
+		SDKQuietFile(stdParms, SDKfileRef, privateData);
+	}
+
+	// Remove the privateData handle.
+	// CLEANUP - Destroy the handle we created to avoid memory leaks
+	if(ldataH && *ldataH)
+	{
+		stdParms->piSuites->memFuncs->lockHandle(reinterpret_cast<char**>(ldataH));
+
+		ImporterLocalRec8Ptr localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *ldataH );;
+		
+		free_clip(localRecP);
+
+		stdParms->piSuites->memFuncs->disposeHandle(reinterpret_cast<PrMemoryHandle>(ldataH));
+	}
+
+	return malNoError;
+}
+
+
+
+static prMALError 
+SDKAnalysis(
+	imStdParms		* /*stdParms*/,
+	imFileRef		/*SDKfileRef*/,
+	imAnalysisRec	*SDKAnalysisRec)
+{
+	// Is this all I'm supposed to do here?
+	// The string shows up in the properties dialog.
+	ImporterLocalRec8H ldataH = reinterpret_cast<ImporterLocalRec8H>(SDKAnalysisRec->privatedata);
+	ImporterLocalRec8Ptr localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *ldataH );
+
+	std::stringstream ss;
+	
+	// actually, this is already reported, what do I have to add?
+	ss << localRecP->numChannels << " channels, " << localRecP->audioSampleRate << " Hz";
+	
+	if( g_audio_cache.enabled() )
+	{
+		// so we can see how well the cache is sized
+		size_t bytes = 0, packed_bytes = 0;
+		unsigned int hits = 0, misses = 0;
+		
+		g_audio_cache.get_stats(&bytes, &packed_bytes, &hits, &misses);
+		
+		ss << ", audio cache " << (bytes / (1024 * 1024)) << " MB + " << (packed_bytes / (1024 * 1024)) << " MB packed, " << hits << " hits, " << misses << " misses";
+	}
+	
+	if(localRecP->conformed != NULL)
+		ss << ", playing from disk cache";
+	
+	if(SDKAnalysisRec->buffersize > (csSDK_int32)ss.str().size())
+		strcpy(SDKAnalysisRec->buffer, ss.str().c_str());
+
+	return malNoError;
+}
+
+
+
+
+prMALError 
+SDKGetInfo8(
+	imStdParms			*stdParms, 
+	imFileAccessRec8	* /*fileAccessInfo8*/, 
+	imFileInfoRec8		*SDKFileInfo8)
+{
+	prMALError					result				= malNoError;
+
+
+	SDKFileInfo8->hasDataRate						= kPrFalse;
+
+
+	// private data
+	assert(SDKFileInfo8->privatedata);
+	ImporterLocalRec8H ldataH = reinterpret_cast<ImporterLocalRec8H>(SDKFileInfo8->privatedata);
+	stdParms->piSuites->memFuncs->lockHandle(reinterpret_cast<char**>(ldataH));
+	ImporterLocalRec8Ptr localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *ldataH );
+
+
+	SDKFileInfo8->hasVideo = kPrFalse;
+	SDKFileInfo8->hasAudio = kPrFalse;
+	
+	
+	if(localRecP)
+	{
+		const ClipInfo &info = localRecP->info;
+		
+		const int bitDepth = info.bitsPerSample;
+		
+		SDKFileInfo8->hasAudio				= kPrTrue;
+		SDKFileInfo8->audInfo.numChannels	= info.channels;
+		SDKFileInfo8->audInfo.sampleRate	= info.sampleRate;
+		SDKFileInfo8->audInfo.sampleType	= bitDepth == 8 ? kPrAudioSampleType_8BitInt :
+												bitDepth == 16 ? kPrAudioSampleType_16BitInt :
+												bitDepth == 24 ? kPrAudioSampleType_24BitInt :
+												bitDepth == 32 ? kPrAudioSampleType_32BitInt :
+												bitDepth == 64 ? kPrAudioSampleType_64BitFloat :
+												kPrAudioSampleType_Compressed;
+		
+		SDKFileInfo8->audDuration			= info.duration;
+
+		localRecP->audioSampleRate			= SDKFileInfo8->audInfo.sampleRate;
+		localRecP->numChannels				= SDKFileInfo8->audInfo.numChannels;
+		
+		
+		if(SDKFileInfo8->audInfo.numChannels > 2 && SDKFileInfo8->audInfo.numChannels != 6)
+		{
+			// Premiere can't handle anything but Mono, Stereo, and 5.1
+			result = imUnsupportedAudioFormat;
+		}
+	}
+		
+	stdParms->piSuites->memFuncs->unlockHandle(reinterpret_cast<char**>(ldataH));
+
+	return result;
+}
+
+
+
+
+// How far back from the sample we want to start decoding after an indexed seek.
+// Vorbis needs the previous block (up to 8192 samples long) to overlap with,
+// Opus needs 80 ms to converge.
+enum {
+	VORBIS_PREROLL	= 8192,
+	OPUS_PREROLL	= 3840,
+	MAX_DISCARD		= 48000 * 4 // if the index leaves us further back than this, let the library seek
+};
+
+
+static int
+indexed_seek_vorbis(OggVorbis_File *vf, const SeekIndex *index, ogg_int64_t position)
+{
+	SeekIndex::Point point;
+	
+	if(!index->find(position - VORBIS_PREROLL, &point) || ov_raw_seek(vf, point.offset) != OV_OK)
+		return OV_EINVAL;
+	
+	ogg_int64_t pcm = ov_pcm_tell(vf);
+	
+	if(pcm < 0 || pcm > position || position - pcm > MAX_DISCARD)
+		return OV_EINVAL;
+	
+	while(pcm < position)
+	{
+		float **pcm_channels;
+		int link = 0;
+		
+		long samples = ov_read_float(vf, &pcm_channels, (position - pcm < 1024 ? position - pcm : 1024), &link);
+		
+		if(samples <= 0)
+			return OV_EINVAL;
+		
+		pcm += samples;
+	}
+	
+	return OV_OK;
+}
+
+
+static int
+indexed_seek_opus(OggOpusFile *opus, const SeekIndex *index, ogg_int64_t position)
+{
+	const OpusHead *head = op_head(opus, -1);
+	
+	if(head == NULL)
+		return OP_EINVAL;
+	
+	// the index has granule positions, which include the pre-skip
+	SeekIndex::Point point;
+	
+	if(!index->find(position + head->pre_skip - OPUS_PREROLL, &point) || op_raw_seek(opus, point.offset) != 0)
+		return OP_EINVAL;
+	
+	ogg_int64_t pcm = op_pcm_tell(opus);
+	
+	if(pcm < 0 || pcm > position || position - pcm > MAX_DISCARD)
+		return OP_EINVAL;
+	
+	float discard[1024 * 8];
+	
+	const int channels = op_channel_count(opus, -1);
+	
+	while(pcm < position)
+	{
+		const int want = (position - pcm < 1024 ? position - pcm : 1024);
+		
+		int samples = op_read_float(opus, discard, want * channels, NULL);
+		
+		if(samples <= 0)
+			return OP_EINVAL;
+		
+		pcm += samples;
+	}
+	
+	return 0;
+}
+
+
+enum {
+	OPUS_WINDOW = 5760 // 120 ms at 48k, the longest an Opus packet can be
+};
+
+
+// Decode straight from the file.  Returns the number of samples in *samples_decoded,
+// which will be less than size at the end of the file.  When approximate, we read on from
+// wherever the decoder is (scrubbing has just put it near position) and don't pretend
+// to know where that left us.
+static prMALError
+decode_audio(
+	ImporterLocalRec8Ptr	localRecP,
+	float					**buffers,
+	ogg_int64_t				position,
+	long					size,
+	long					*samples_decoded_out,
+	bool					approximate = false)
+{
+	prMALError		result		= malNoError;
+	
+	assert(position >= 0);
+	
+	const bool contiguous = (approximate || position == localRecP->pcmPosition);
+	
+	localRecP->pcmPosition = -1; // until we know where we ended up
+	
+	long samples_decoded = -1; // stays that way if something went wrong
+	
+	
+	if(localRecP->fileType == Ogg_filetype && localRecP->vf != NULL)
+	{
+		OggVorbis_File &vf = *localRecP->vf;
+		
+		int seek_err = OV_OK;
+		
+		if(!contiguous)
+		{
+			seek_err = OV_EINVAL;
+			
+			if(localRecP->seekIndex != NULL)
+				seek_err = indexed_seek_vorbis(&vf, localRecP->seekIndex, position);
+			
+			if(seek_err != OV_OK)
+				seek_err = ov_pcm_seek(&vf, position);
+		}
+			
+		
+		if(seek_err == OV_OK)
+		{
+			int num = 0;
+			float **pcm_channels;
+			
+			long samples_needed = size;
+			long pos = 0;
+			
+			while(samples_needed > 0 && result == malNoError)
+			{
+				int samples = samples_needed;
+				
+				if(samples > 1024)
+					samples = 1024; // maximum size this call can read at once
+			
+				long samples_read = ov_read_float(&vf, &pcm_channels, samples, &num);
+				
+				if(samples_read >= 0)
+				{
+					if(samples_read == 0)
+					{
+						// EOF
+						// Premiere will keep asking me for more and more samples,
+						// even beyond what I told it I had in SDKFileInfo8->audDuration.
+						// Just stop and everything will be fine.
+						break;
+					}
+					
+					// num is the link this came from, which in a chained file
+					// might not have as many channels as the clip
+					vorbis_info *vinfo = ov_info(&vf, num);
+					
+					const int link_channels = (vinfo != NULL ? vinfo->channels : 0);
+					
+					float *channel[6];
+					
+					if(link_channels == localRecP->numChannels)
+					{
+						to_premiere_order(VORBIS_LAYOUT, localRecP->numChannels, pcm_channels, channel);
+						
+						for(int i=0; i < localRecP->numChannels; i++)
+						{
+							memcpy(&buffers[i][pos], channel[i], samples_read * sizeof(float));
+						}
+					}
+					else if(link_channels > 0 && link_channels <= 6)
+					{
+						float *dest[6];
+						
+						for(int i=0; i < localRecP->numChannels; i++)
+							dest[i] = &buffers[i][pos];
+						
+						to_premiere_order(VORBIS_LAYOUT, link_channels, pcm_channels, channel);
+						
+						convert_channels(channel, link_channels, dest, localRecP->numChannels, samples_read);
+					}
+					else
+					{
+						result = imDecompressionError;
+						
+						break;
+					}
+					
+					samples_needed -= samples_read;
+					pos += samples_read;
+				}
+				else
+					result = imDecompressionError;
+			}
+			
+			samples_decoded = pos;
+		}
+	}
+	else if(localRecP->fileType == Opus_filetype && localRecP->opus != NULL)
+	{
+		const int num_channels = localRecP->numChannels;
+		
+		// In a chained file, op_read_float() gives us as many samples as fit in the
+		// buffer for whatever link it's in, so asking for what fits with the fewest
+		// channels keeps us inside the window.
+		const int read_channels = (localRecP->links != NULL && localRecP->links->min_channels() > 0 ?
+									localRecP->links->min_channels() : num_channels);
+		
+		std::vector<float> link_pcm; // for links that need converting
+		
+		
+		int seek_err = OV_OK;
+		
+		if(!contiguous)
+		{
+			seek_err = OP_EINVAL;
+			
+			if(localRecP->seekIndex != NULL)
+				seek_err = indexed_seek_opus(localRecP->opus, localRecP->seekIndex, position);
+			
+			if(seek_err != OV_OK)
+				seek_err = op_pcm_seek(localRecP->opus, position);
+		}
+			
+		
+		// The decoder's window sticks around, so this doesn't allocate every time, and its
+		// size doesn't depend on how much Premiere asks for.
+		if(localRecP->opusWindow == NULL)
+			localRecP->opusWindow = (float *)aligned_malloc(sizeof(float) * OPUS_WINDOW * num_channels);
+		
+		if(seek_err == OV_OK)
+		{
+			float *_pcm = localRecP->opusWindow;
+			
+			if(_pcm != NULL)
+			{
+				long samples_needed = size;
+				long pos = 0;
+				
+				while(samples_needed > 0 && result == malNoError)
+				{
+					const int window = (samples_needed < OPUS_WINDOW ? samples_needed : (long)OPUS_WINDOW);
+					
+					int link = 0;
+					
+					int samples_read = op_read_float(localRecP->opus, _pcm, window * read_channels, &link);
+					
+					const OpusHead *head = op_head(localRecP->opus, link);
+					
+					const int link_channels = (head != NULL ? head->channel_count : 0);
+					
+					if(samples_read == 0)
+					{
+						// guess we're at the end of the stream
+						break;
+					}
+					else if(samples_read < 0 || link_channels <= 0 || link_channels > 6)
+					{
+						result = imDecompressionError;
+					}
+					else
+					{
+						float *dest[6], *out[6];
+						
+						for(int c=0; c < num_channels; c++)
+							dest[c] = buffers[c] + pos;
+						
+						if(link_channels == num_channels)
+						{
+							// out[c] is where Opus channel c goes
+							to_layout_order(VORBIS_LAYOUT, num_channels, dest, out);
+							
+							deinterleave(num_channels, _pcm, out, samples_read);
+						}
+						else
+						{
+							// this link gets its own planes, then converted to the clip's channels
+							link_pcm.resize(OPUS_WINDOW * link_channels);
+							
+							float *link_planes[6], *channel[6];
+							
+							for(int c=0; c < link_channels; c++)
+								link_planes[c] = &link_pcm[c * OPUS_WINDOW];
+							
+							deinterleave(link_channels, _pcm, link_planes, samples_read);
+							
+							to_premiere_order(VORBIS_LAYOUT, link_channels, link_planes, channel);
+							
+							convert_channels(channel, link_channels, dest, num_channels, samples_read);
+						}
+						
+						samples_needed -= samples_read;
+						pos += samples_read;
+					}
+				}
+				
+				samples_decoded = pos;
+			}
+		}
+	}
+	else if(localRecP->fileType == FLAC_filetype && localRecP->flac != NULL)
+	{
+		try
+		{
+			assert((int)localRecP->flac->get_channels() == localRecP->numChannels);
+			
+			
+			localRecP->flac->set_buffers(buffers, size, position);
+			
+			
+			localRecP->flac->read_remainder();
+			
+			const ogg_int64_t next_sample = position + localRecP->flac->get_pos();
+			
+			// If the next frame starts right where we want to be, no need to seek.
+			// Otherwise calling seek will cause flac to "write" some audio, of course!
+			bool sought = true;
+			
+			if(localRecP->flac->get_pos() < (size_t)size && next_sample != localRecP->flac->get_next_sample())
+			{
+				sought = false;
+				
+				// with the index, go to the frame and decode from there
+				FLAC__uint64 frame_sample = 0, frame_offset = 0;
+				
+				bool found = false;
+				
+				if(localRecP->seekIndex != NULL)
+				{
+					SeekIndex::Point point = { 0, 0 };
+					
+					found = localRecP->seekIndex->find(next_sample, &point);
+					
+					frame_sample = point.sample;
+					frame_offset = point.offset;
+				}
+				else // no index yet, maybe we've been near here before
+					found = localRecP->flac->find_frame(next_sample, &frame_sample, &frame_offset);
+				
+				if(found && next_sample - frame_sample < MAX_DISCARD)
+				{
+					// if the first frame we get is past where we want to be, the index is off
+					sought = localRecP->flac->seek_to_frame(frame_offset) &&
+								localRecP->flac->process_single() &&
+								!localRecP->flac->skipped_ahead();
+				}
+				
+				if(!sought)
+				{
+					sought = localRecP->flac->seek_absolute(next_sample);
+				
+					if(!sought)
+					{
+						localRecP->flac->forget_next_sample();
+						
+						if(localRecP->flac->get_state() == FLAC__STREAM_DECODER_SEEK_ERROR)
+							localRecP->flac->flush();
+					}
+				}
+			}
+			
+			
+			if(sought)
+			{
+				while(localRecP->flac->get_pos() < (size_t)size &&
+						localRecP->flac->get_state() != FLAC__STREAM_DECODER_END_OF_STREAM)
+				{
+					bool processed = localRecP->flac->process_single();
+					
+					if(!processed)
+						break;
+				}
+				
+				samples_decoded = localRecP->flac->get_pos();
+			}
+			
+			localRecP->flac->set_buffers(NULL, 0, 0); // don't trust libflac not to write at inopportune times
+		}
+		catch(...)
+		{
+			result = imDecompressionError;
+		}
+	}
+	
+	if(result == malNoError && samples_decoded >= 0 && !approximate)
+		localRecP->pcmPosition = position + samples_decoded;
+	
+	*samples_decoded_out = (samples_decoded > 0 ? samples_decoded : 0);
+	
+	return result;
+}
+
+
+enum {
+	SCRUB_MAX_SAMPLES	= 8192,	// scrubbing asks for little bits at a time...
+	SCRUB_JUMPS			= 3		// ...from a different place each time
+};
+
+
+// When a few tracks play the same clip, their requests take turns, each one picking up
+// where that track's last one ended.  So we remember where the last few ended, and a
+// request only counts as a jump if it doesn't follow any of them.  Either way, it takes
+// the place of the one it followed, or the oldest.
+static bool
+follow_request(ImporterLocalRec8Ptr localRecP, ogg_int64_t position, ogg_int64_t end)
+{
+	int stream = -1;
+	
+	for(int i=0; i < REQUEST_STREAMS && stream < 0; i++)
+	{
+		if(localRecP->requestEnds[i] == position)
+			stream = i;
+	}
+	
+	const bool followed = (stream >= 0);
+	
+	if(!followed)
+		stream = (localRecP->lastRequest + 1) % REQUEST_STREAMS;
+	
+	localRecP->requestEnds[stream] = end;
+	localRecP->lastRequest = stream;
+	
+	return followed;
+}
+
+
+// For scrubbing, when being quick matters more than being exactly in the right place.
+// We seek to a page or frame near position and hand back whatever's there, without
+// decoding up to the exact sample first.  None of this can go in the cache, of course.
+static prMALError
+scrub_audio(
+	ImporterLocalRec8Ptr	localRecP,
+	float					**buffers,
+	ogg_int64_t				position,
+	long					size,
+	long					*samples_read)
+{
+	if(position == localRecP->pcmPosition)
+		return decode_audio(localRecP, buffers, position, size, samples_read);
+	
+	
+	prMALError result = malNoError;
+	
+	bool sought = false;
+	
+	if(localRecP->vf != NULL)
+	{
+		sought = (ov_pcm_seek_page(localRecP->vf, position) == OV_OK);
+	}
+	else if(localRecP->opus != NULL)
+	{
+		const OpusHead *head = op_head(localRecP->opus, -1);
+		
+		SeekIndex::Point point;
+		
+		ogg_int64_t offset = -1;
+		
+		if(localRecP->seekIndex != NULL && head != NULL &&
+			localRecP->seekIndex->find(position + head->pre_skip, &point))
+		{
+			offset = point.offset;
+		}
+		else if(localRecP->links != NULL && localRecP->links->count() > 0)
+		{
+			// guess within the link, opusfile will find the next page
+			const OggLink &link = (*localRecP->links)[ localRecP->links->find(position) ];
+			
+			if(link.samples > 0)
+				offset = link.offset + (ogg_int64_t)((double)(position - link.sample) / (double)link.samples * (double)link.bytes);
+		}
+		else if(localRecP->info.duration > 0)
+		{
+			offset = (double)position / (double)localRecP->info.duration * (double)localRecP->source->get_size();
+		}
+		
+		sought = (offset >= 0 && op_raw_seek(localRecP->opus, offset) == 0);
+	}
+	else if(localRecP->flac != NULL)
+	{
+		// FLAC has to start at a real frame, libFLAC doesn't like losing sync
+		FLAC__uint64 frame_sample = 0, frame_offset = 0;
+		
+		bool found = false;
+		
+		if(localRecP->seekIndex != NULL)
+		{
+			SeekIndex::Point point = { 0, 0 };
+			
+			found = localRecP->seekIndex->find(position, &point);
+			
+			frame_offset = point.offset;
+		}
+		else
+			found = localRecP->flac->find_frame(position, &frame_sample, &frame_offset);
+		
+		if(found)
+		{
+			long samples = 0;
+			
+			try
+			{
+				localRecP->flac->set_buffers(buffers, size, position);
+				localRecP->flac->set_approximate(true);
+				
+				if( localRecP->flac->seek_to_frame(frame_offset) )
+				{
+					while(localRecP->flac->get_pos() < (size_t)size &&
+							localRecP->flac->get_state() != FLAC__STREAM_DECODER_END_OF_STREAM)
+					{
+						if( !localRecP->flac->process_single() )
+							break;
+					}
+					
+					samples = localRecP->flac->get_pos();
+				}
+			}
+			catch(...)
+			{
+				localRecP->flac->forget_next_sample();
+				
+				result = imDecompressionError;
+			}
+			
+			localRecP->flac->set_approximate(false);
+			localRecP->flac->set_buffers(NULL, 0, 0);
+			
+			localRecP->pcmPosition = -1;
+			
+			*samples_read = samples;
+			
+			return result;
+		}
+	}
+	
+	if(!sought)
+		return decode_audio(localRecP, buffers, position, size, samples_read);
+	
+	
+	// the decoder is somewhere near position now, so decode_audio() leaves pcmPosition unknown
+	return decode_audio(localRecP, buffers, position, size, samples_read, true);
+}
+
+
+// Switch the decoder between preview and full quality
+static void
+set_preview_decode(ImporterLocalRec8Ptr localRecP, bool preview)
+{
+	OpusPreview *opus_preview = localRecP->opusPreview;
+	
+	if(opus_preview == NULL || opus_preview->enabled == preview)
+		return;
+	
+	opus_preview->enabled = preview;
+	
+	// whichever decoder takes over missed the packets in between, so seek to warm it up
+	localRecP->pcmPosition = -1;
+}
+
+
+// Playback audio at preview quality.  Like scrubbing, this never goes in the cache.
+static prMALError
+preview_audio(
+	ImporterLocalRec8Ptr	localRecP,
+	float					**buffers,
+	ogg_int64_t				position,
+	long					size,
+	long					*samples_read)
+{
+	set_preview_decode(localRecP, true);
+	
+	// after a seek, opusfile's pre-roll has to go through a fresh decoder
+	if(localRecP->opusPreview != NULL && position != localRecP->pcmPosition)
+		reset_opus_preview(localRecP->opusPreview);
+	
+	return decode_audio(localRecP, buffers, position, size, samples_read);
+}
+
+
+// Fill the request from cached blocks, decoding the ones we don't have yet
+static prMALError
+read_cached_audio(
+	ImporterLocalRec8Ptr	localRecP,
+	float					**buffers,
+	ogg_int64_t				position,
+	long					size,
+	long					*samples_read)
+{
+	prMALError		result		= malNoError;
+	
+	const int block_samples = AudioCache::BLOCK_SAMPLES;
+	
+	const int num_channels = localRecP->numChannels;
+	
+	if(localRecP->blockBuffer == NULL)
+	{
+		localRecP->blockBuffer = (float *)malloc(sizeof(float) * block_samples * num_channels);
+		
+		if(localRecP->blockBuffer == NULL)
+			return decode_audio(localRecP, buffers, position, size, samples_read);
+	}
+	
+	float *block_buffers[6];
+	
+	for(int c=0; c < num_channels; c++)
+		block_buffers[c] = localRecP->blockBuffer + (c * block_samples);
+	
+	
+	long pos = 0;
+	
+	while(pos < size && result == malNoError)
+	{
+		const ogg_int64_t sample = position + pos;
+		
+		const ogg_int64_t index = sample / block_samples;
+		
+		const long offset = (sample - (index * block_samples));
+		
+		long samples = size - pos;
+		
+		if(samples > block_samples - offset)
+			samples = block_samples - offset;
+		
+		float *out_buffers[6];
+		
+		for(int c=0; c < num_channels; c++)
+			out_buffers[c] = buffers[c] + pos;
+		
+		long block_length = 0;
+		
+		if( !g_audio_cache.read(localRecP->identity, index, num_channels, offset, samples, out_buffers, &block_length) )
+		{
+			result = decode_audio(localRecP, block_buffers, index * block_samples, block_samples, &block_length);
+			
+			if(result == malNoError && block_length > 0)
+			{
+				g_audio_cache.store(localRecP->identity, index, num_channels, block_buffers, block_length);
+				
+				if(offset < block_length)
+				{
+					for(int c=0; c < num_channels; c++)
+					{
+						memcpy(out_buffers[c], block_buffers[c] + offset,
+								sizeof(float) * (samples < block_length - offset ? samples : block_length - offset));
+					}
+				}
+			}
+		}
+		
+		if(offset >= block_length)
+			break; // past the end of the file
+		
+		if(samples > block_length - offset)
+			samples = block_length - offset;
+		
+		pos += samples;
+		
+		if(block_length < block_samples)
+			break; // last block
+	}
+	
+	*samples_read = pos;
+	
+	return result;
+}
+
+
+// Cache or decoder, whichever fits
+static prMALError
+import_audio(
+	ImporterLocalRec8Ptr	localRecP,
+	float					**buffers,
+	ogg_int64_t				position,
+	long					size,
+	long					*samples_read)
+{
+	if(g_audio_cache.enabled() && localRecP->identity.size > 0)
+		return read_cached_audio(localRecP, buffers, position, size, samples_read);
+	else
+		return decode_audio(localRecP, buffers, position, size, samples_read);
+}
+
+
+#pragma mark-
+
+
+// Big requests (rendering, exporting) get split up and decoded by several decoders at
+// once.  Vorbis, Opus and FLAC all start decoding cleanly after a seek, so each piece
+// only has to take care of its own pre-roll, which decode_audio() already does.
+
+enum {
+	MAX_DECODE_THREADS	= 8,
+	MIN_CHUNK_BLOCKS	= 16 // about 1.5 seconds at 44.1k, anything less isn't worth a decoder
+};
+
+
+// One piece of the request, on a decoder borrowed from the clip's pool.  They stay open
+// between requests, and the pool hands out the one nearest to where the piece starts,
+// so the pieces of one render request often pick up right where the last one's ended.
+class DecodeWorker : public Thread
+{
+  public:
+	DecodeWorker(ImporterLocalRec8Ptr localRecP, float **buffers, ogg_int64_t position, long size);
+	virtual ~DecodeWorker();
+	
+	bool succeeded() const { return _ok; }
+	long samples_read() const { return _samples_read; }
+	
+  protected:
+	virtual void run();
+	
+  private:
+	ImporterLocalRec8Ptr _localRecP; // the clip, for its pool
+	
+	float *_buffers[6];
+	const ogg_int64_t _position;
+	const long _size;
+	
+	bool _ok;
+	long _samples_read;
+};
+
+
+DecodeWorker::DecodeWorker(ImporterLocalRec8Ptr localRecP, float **buffers, ogg_int64_t position, long size) :
+	_localRecP(localRecP),
+	_position(position),
+	_size(size),
+	_ok(false),
+	_samples_read(0)
+{
+	for(int c=0; c < localRecP->numChannels; c++)
+		_buffers[c] = buffers[c];
+}
+
+
+DecodeWorker::~DecodeWorker()
+{
+	join();
+}
+
+
+void
+DecodeWorker::run()
+{
+	// if they're all busy, the thread that started us does this piece itself
+	ImporterLocalRec8Ptr decoderRecP = _localRecP->decoderPool->acquire(_localRecP, _position, false);
+	
+	if(decoderRecP != NULL)
+	{
+		try
+		{
+			set_preview_decode(decoderRecP, false);
+			
+			_ok = (import_audio(decoderRecP, _buffers, _position, _size, &_samples_read) == malNoError);
+		}
+		catch(...)
+		{
+			_ok = false;
+		}
+		
+		_localRecP->decoderPool->release(decoderRecP);
+	}
+}
+
+
+static int
+decode_thread_count()
+{
+	int threads = get_setting(SETTING_DECODE_THREADS, 0);
+	
+	if(threads <= 0)
+		threads = cpu_count();
+	
+	return (threads < MAX_DECODE_THREADS ? threads : MAX_DECODE_THREADS);
+}
+
+
+// Split the request on cache block boundaries and hand all but the last piece to
+// workers.  We decode the last piece ourselves on decoderRecP, which the clip's pool
+// (localRecP->decoderPool) already gave us, so it ends up where the next request
+// probably starts.
+static prMALError
+parallel_import_audio(
+	ImporterLocalRec8Ptr	localRecP,
+	ImporterLocalRec8Ptr	decoderRecP,
+	float					**buffers,
+	ogg_int64_t				position,
+	long					size,
+	long					*samples_read)
+{
+	const int num_channels = localRecP->numChannels;
+	
+	const long block_samples = AudioCache::BLOCK_SAMPLES;
+	
+	const ogg_int64_t first_block = position / block_samples;
+	const ogg_int64_t end_block = (position + size + block_samples - 1) / block_samples;
+	
+	int chunks = decode_thread_count();
+	
+	// every piece needs a decoder from the pool
+	if(chunks > localRecP->decoderPool->max_decoders())
+		chunks = localRecP->decoderPool->max_decoders();
+	
+	if(chunks > (end_block - first_block) / MIN_CHUNK_BLOCKS)
+		chunks = (end_block - first_block) / MIN_CHUNK_BLOCKS;
+	
+	// no use starting decoders for audio that's already in the cache
+	if(chunks > 1 && g_audio_cache.enabled() && localRecP->identity.size > 0)
+	{
+		ogg_int64_t missing = 0;
+		
+		for(ogg_int64_t i = first_block; i < end_block; i++)
+		{
+			if( !g_audio_cache.contains(localRecP->identity, i, num_channels) )
+				missing++;
+		}
+		
+		if(chunks > missing / MIN_CHUNK_BLOCKS)
+			chunks = missing / MIN_CHUNK_BLOCKS;
+	}
+	
+	if(chunks < 2)
+		return import_audio(decoderRecP, buffers, position, size, samples_read);
+	
+	
+	std::vector<ogg_int64_t> starts(chunks + 1);
+	
+	for(int i=0; i < chunks; i++)
+	{
+		const ogg_int64_t block = first_block + ((end_block - first_block) * i / chunks);
+		
+		starts[i] = (i == 0 ? position : block * block_samples);
+	}
+	
+	starts[chunks] = position + size;
+	
+	
+	std::vector<DecodeWorker *> workers(chunks - 1, (DecodeWorker *)NULL);
+	
+	for(int i=0; i < chunks - 1; i++)
+	{
+		float *chunk_buffers[6];
+		
+		for(int c=0; c < num_channels; c++)
+			chunk_buffers[c] = buffers[c] + (starts[i] - position);
+		
+		workers[i] = new DecodeWorker(localRecP, chunk_buffers, starts[i], starts[i + 1] - starts[i]);
+		
+		if( !workers[i]->start() )
+		{
+			delete workers[i];
+			
+			workers[i] = NULL;
+		}
+	}
+	
+	
+	std::vector<long> chunk_read(chunks, 0);
+	
+	float *last_buffers[6];
+	
+	for(int c=0; c < num_channels; c++)
+		last_buffers[c] = buffers[c] + (starts[chunks - 1] - position);
+	
+	prMALError result = import_audio(decoderRecP, last_buffers, starts[chunks - 1],
+										starts[chunks] - starts[chunks - 1], &chunk_read[chunks - 1]);
+	
+	for(int i=0; i < chunks - 1; i++)
+	{
+		bool done = false;
+		
+		if(workers[i] != NULL)
+		{
+			workers[i]->join();
+			
+			done = workers[i]->succeeded();
+			
+			chunk_read[i] = workers[i]->samples_read();
+			
+			delete workers[i];
+		}
+		
+		// if a worker couldn't do it, we'll have to
+		if(!done && result == malNoError)
+		{
+			float *chunk_buffers[6];
+			
+			for(int c=0; c < num_channels; c++)
+				chunk_buffers[c] = buffers[c] + (starts[i] - position);
+			
+			result = import_audio(decoderRecP, chunk_buffers, starts[i], starts[i + 1] - starts[i], &chunk_read[i]);
+		}
+	}
+	
+	
+	// only count audio up to the first piece that came up short, that's the end of the file
+	long total = 0;
+	
+	for(int i=0; i < chunks; i++)
+	{
+		total += chunk_read[i];
+		
+		if(chunk_read[i] < starts[i + 1] - starts[i])
+			break;
+	}
+	
+	*samples_read = total;
+	
+	return result;
+}
+
+
+#pragma mark-
+
+
+// Premiere waits for every audio request, so a seek in a long clip or a slow network
+// stalls playback.  While it plays, this decodes the next few seconds into the cache
+// with its own decoder.  A clip only has a thread for that while it has blocks to do,
+// and only a couple of clips get one at a time.  When the playhead jumps, whatever was
+// queued for the old spot gets dropped before the next block.
+class ReadAhead : public Thread
+{
+  public:
+	// NULL if read-ahead is turned off or wouldn't do any good
+	static ReadAhead * create(ImporterLocalRec8Ptr localRecP);
+	
+	virtual ~ReadAhead();
+	
+	// Premiere just asked for audio ending here
+	void request(ogg_int64_t position);
+	
+  protected:
+	virtual void run();
+	
+  private:
+	ReadAhead(ImporterLocalRec8Ptr localRecP, ogg_int64_t ahead_blocks);
+	
+	bool open_decoder();
+	
+	// the next block to do, false if there's nothing left or we should stop
+	bool next_block(ogg_int64_t *index);
+	
+	ImporterLocalRec8 _rec;
+	
+	std::vector<prUTF16Char> _path;
+	const FileSource *_memory;
+	imFileRef _fp;
+	
+	const ogg_int64_t _ahead_blocks;
+	
+	Mutex _mutex;
+	
+	// the blocks still to do
+	ogg_int64_t _next_block;
+	ogg_int64_t _end_block;
+	
+	bool _running; // the thread is going, and has one of the slots
+	bool _opened; // the thread has tried to open the decoder
+	bool _failed; // ...and couldn't
+};
+
+
+// All the clips together only get this many read-ahead threads
+static Mutex g_read_ahead_mutex;
+static int g_read_aheads = 0;
+
+enum { MAX_READ_AHEADS = 2 };
+
+
+ReadAhead::ReadAhead(ImporterLocalRec8Ptr localRecP, ogg_int64_t ahead_blocks) :
+	_memory(localRecP->source != NULL && localRecP->source->get_data() != NULL ? localRecP->source : NULL),
+	_fp(imInvalidHandleValue),
+	_ahead_blocks(ahead_blocks),
+	_next_block(0),
+	_end_block(0),
+	_running(false),
+	_opened(false),
+	_failed(false)
+{
+	memset(&_rec, 0, sizeof(_rec));
+	
+	_rec.fileType = localRecP->fileType;
+	_rec.numChannels = localRecP->numChannels;
+	_rec.audioSampleRate = localRecP->audioSampleRate;
+	_rec.identity = localRecP->identity;
+	_rec.info = localRecP->info;
+	_rec.seekIndex = localRecP->seekIndex; // for jumps, if we have it yet
+	_rec.pcmPosition = -1;
+	
+	if(_memory == NULL)
+		copy_path(localRecP->filePath, _path);
+}
+
+
+ReadAhead::~ReadAhead()
+{
+	cancel();
+	
+	join();
+	
+	close_decoder(&_rec);
+	
+	if(_rec.blockBuffer != NULL)
+		free(_rec.blockBuffer);
+	
+	if(_fp != imInvalidHandleValue)
+		close_file(_fp);
+}
+
+
+ReadAhead *
+ReadAhead::create(ImporterLocalRec8Ptr localRecP)
+{
+	const int seconds = get_setting(SETTING_READ_AHEAD, 5);
+	
+	if(seconds <= 0 || !g_audio_cache.enabled() || localRecP->identity.size <= 0 ||
+		localRecP->source == NULL || (localRecP->source->get_data() == NULL && localRecP->filePath == NULL))
+		return NULL;
+	
+	const ogg_int64_t ahead_blocks = ((ogg_int64_t)seconds * (ogg_int64_t)localRecP->audioSampleRate) / AudioCache::BLOCK_SAMPLES + 1;
+	
+	return new ReadAhead(localRecP, ahead_blocks);
+}
+
+
+void
+ReadAhead::request(ogg_int64_t position)
+{
+	const ogg_int64_t block = position / AudioCache::BLOCK_SAMPLES;
+	
+	ScopedLock lock(_mutex);
+	
+	// Did we jump, or has playback caught up with us?  If we're just ahead of it,
+	// keep going from where we are.
+	if(block > _next_block || block + _ahead_blocks < _next_block)
+		_next_block = block;
+	
+	_end_block = block + _ahead_blocks;
+	
+	if(_running || _failed || _next_block >= _end_block)
+		return;
+	
+	{
+		ScopedLock slots(g_read_ahead_mutex);
+		
+		if(g_read_aheads >= MAX_READ_AHEADS)
+			return; // maybe next time
+		
+		g_read_aheads++;
+	}
+	
+	join(); // the last run is over, it's just returning
+	
+	_running = start();
+	
+	if(!_running)
+	{
+		ScopedLock slots(g_read_ahead_mutex);
+		
+		g_read_aheads--;
+	}
+}
+
+
+bool
+ReadAhead::next_block(ogg_int64_t *index)
+{
+	ScopedLock lock(_mutex);
+	
+	if(_next_block >= _end_block || _failed || cancelled())
+	{
+		// request() starts us up again when there's more
+		_running = false;
+		
+		ScopedLock slots(g_read_ahead_mutex);
+		
+		g_read_aheads--;
+		
+		return false;
+	}
+	
+	*index = _next_block++;
+	
+	return true;
+}
+
+
+bool
+ReadAhead::open_decoder()
+{
+	FileSource *source = NULL;
+	
+	if(_memory != NULL)
+	{
+		source = new SharedSource(_memory);
+	}
+	else
+	{
+		_fp = open_file(&_path[0]);
+		
+		if(_fp != imInvalidHandleValue)
+			source = new BlockCache(_fp);
+	}
+	
+	return (source != NULL && ::open_decoder(&_rec, source) == malNoError);
+}
+
+
+void
+ReadAhead::run()
+{
+	const long block_samples = AudioCache::BLOCK_SAMPLES;
+	
+	if(!_opened)
+	{
+		_opened = true;
+		
+		if( !open_decoder() )
+		{
+			ScopedLock lock(_mutex);
+			
+			_failed = true;
+		}
+	}
+	
+	std::vector<float> block(block_samples * _rec.numChannels);
+	
+	float *buffers[6];
+	
+	for(int c=0; c < _rec.numChannels; c++)
+		buffers[c] = &block[c * block_samples];
+	
+	ogg_int64_t index = -1;
+	
+	while( next_block(&index) )
+	{
+		if( g_audio_cache.contains(_rec.identity, index, _rec.numChannels) )
+			continue;
+		
+		long decoded = 0;
+		
+		prMALError result = decode_audio(&_rec, buffers, index * block_samples, block_samples, &decoded);
+		
+		if(result == malNoError && decoded > 0)
+			g_audio_cache.store(_rec.identity, index, _rec.numChannels, buffers, decoded);
+		
+		if(result != malNoError || decoded < block_samples)
+		{
+			// end of the file, nothing more to do until we go somewhere else
+			ScopedLock lock(_mutex);
+			
+			if(_next_block > index)
+				_end_block = _next_block;
+		}
+	}
+}
+
 
-		stdParms->piSuites->memFuncs->lockHandle(reinterpret_cast<char**>(ldataH));
+static void
+delete_read_ahead(ReadAhead *read_ahead)
+{
+	delete read_ahead;
+}
 
-		ImporterLocalRec8Ptr localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *ldataH );
 
+#pragma mark-
 
-		if(localRecP->vf)
-		{
-			int clear_err = ov_clear(localRecP->vf);
-			
-			assert(clear_err == OV_OK);
-			
-			delete localRecP->vf;
-			
-			localRecP->vf = NULL;
-		}
 
-		if(localRecP->opus)
-		{
-			op_free(localRecP->opus);
-			
-			localRecP->opus = NULL;
-		}
+// Clips being written to the disk cache right now, so two importer instances
+// with the same clip don't both do it
+static Mutex g_building_mutex;
+static std::set<FileIdentity> g_building;
 
-		if(localRecP->flac)
-		{
-			localRecP->flac->finish();
-			
-			delete localRecP->flac;
-			
-			localRecP->flac = NULL;
-		}
+enum { MAX_DISK_BUILDERS = 2 }; // decoding is plenty of work for the CPU as it is
 
-		stdParms->piSuites->memFuncs->unlockHandle(reinterpret_cast<char**>(ldataH));
 
-	#ifdef PRWIN_ENV
-		CloseHandle(*SDKfileRef);
-	#else
-		FSCloseFork( CAST_REFNUM(*SDKfileRef) );
-	#endif
+class DiskCacheBuilder : public Thread
+{
+  public:
+	// NULL if we can't start one right now
+	static DiskCacheBuilder * create(ImporterLocalRec8Ptr localRecP, const PathString &dir);
 	
-		*SDKfileRef = imInvalidHandleValue;
-	}
+	virtual ~DiskCacheBuilder(); // stops the thread if it's still going
+	
+  protected:
+	virtual void run();
+	
+  private:
+	DiskCacheBuilder(ImporterLocalRec8Ptr localRecP, const PathString &dir);
+	
+	bool build(const PathString &temp_path);
+	
+	std::vector<prUTF16Char> _path;
+	const FileIdentity _identity;
+	const csSDK_int32 _fileType;
+	const int _numChannels;
+	const float _sampleRate;
+	const PathString _dir;
+};
 
-	return malNoError; 
+
+DiskCacheBuilder::DiskCacheBuilder(ImporterLocalRec8Ptr localRecP, const PathString &dir) :
+	_identity(localRecP->identity),
+	_fileType(localRecP->fileType),
+	_numChannels(localRecP->numChannels),
+	_sampleRate(localRecP->audioSampleRate),
+	_dir(dir)
+{
+	copy_path(localRecP->filePath, _path);
 }
 
 
-static prMALError 
-SDKCloseFile(
-	imStdParms			*stdParms, 
-	imFileRef			*SDKfileRef,
-	void				*privateData) 
+DiskCacheBuilder::~DiskCacheBuilder()
 {
-	ImporterLocalRec8H ldataH	= reinterpret_cast<ImporterLocalRec8H>(privateData);
+	cancel();
 	
-	// If file has not yet been closed
-	if(SDKfileRef && *SDKfileRef != imInvalidHandleValue)
+	join();
+}
+
+
+DiskCacheBuilder *
+DiskCacheBuilder::create(ImporterLocalRec8Ptr localRecP, const PathString &dir)
+{
 	{
-		SDKQuietFile(stdParms, SDKfileRef, privateData);
+		ScopedLock lock(g_building_mutex);
+		
+		if(g_building.size() >= MAX_DISK_BUILDERS || g_building.find(localRecP->identity) != g_building.end())
+			return NULL;
+		
+		g_building.insert(localRecP->identity);
 	}
-
-	// Remove the privateData handle.
-	// CLEANUP - Destroy the handle we created to avoid memory leaks
-	if(ldataH && *ldataH)
+	
+	DiskCacheBuilder *builder = new DiskCacheBuilder(localRecP, dir);
+	
+	if( !builder->start() )
 	{
-		stdParms->piSuites->memFuncs->lockHandle(reinterpret_cast<char**>(ldataH));
-
-		ImporterLocalRec8Ptr localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *ldataH );;
-
-		stdParms->piSuites->memFuncs->disposeHandle(reinterpret_cast<PrMemoryHandle>(ldataH));
+		delete builder;
+		
+		ScopedLock lock(g_building_mutex);
+		
+		g_building.erase(localRecP->identity);
+		
+		return NULL;
 	}
-
-	return malNoError;
+	
+	return builder;
 }
 
 
-
-static prMALError 
-SDKAnalysis(
-	imStdParms		*stdParms,
-	imFileRef		SDKfileRef,
-	imAnalysisRec	*SDKAnalysisRec)
+void
+DiskCacheBuilder::run()
 {
-	// Is this all I'm supposed to do here?
-	// The string shows up in the properties dialog.
-	ImporterLocalRec8H ldataH = reinterpret_cast<ImporterLocalRec8H>(SDKAnalysisRec->privatedata);
-	ImporterLocalRec8Ptr localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *ldataH );
-
-	std::stringstream ss;
+	const PathString path = disk_cache_path(_dir, _identity, "pcm");
+	const PathString temp_path = disk_cache_path(_dir, _identity, "pcm.tmp");
 	
-	// actually, this is already reported, what do I have to add?
-	ss << localRecP->numChannels << " channels, " << localRecP->audioSampleRate << " Hz";
+	if( build(temp_path) && rename_file(temp_path, path) )
+		trim_disk_cache(_dir, disk_cache_limit());
+	else
+		delete_file(temp_path);
 	
-	if(SDKAnalysisRec->buffersize > ss.str().size())
-		strcpy(SDKAnalysisRec->buffer, ss.str().c_str());
-
-	return malNoError;
+	ScopedLock lock(g_building_mutex);
+	
+	g_building.erase(_identity);
 }
 
 
-
-
-prMALError 
-SDKGetInfo8(
-	imStdParms			*stdParms, 
-	imFileAccessRec8	*fileAccessInfo8, 
-	imFileInfoRec8		*SDKFileInfo8)
+// Decode the whole clip with our own file handle and decoder
+bool
+DiskCacheBuilder::build(const PathString &temp_path)
 {
-	prMALError					result				= malNoError;
-
-
-	SDKFileInfo8->hasDataRate						= kPrFalse;
+	const prUTF16Char *path = &_path[0];
+	
+	imFileRef fp = open_file(path);
+	
+	if(fp == imInvalidHandleValue)
+		return false;
+	
+	ImporterLocalRec8 localRec;
+	
+	memset(&localRec, 0, sizeof(localRec));
+	
+	localRec.fileType = _fileType;
+	localRec.numChannels = _numChannels;
+	localRec.audioSampleRate = _sampleRate;
+	localRec.pcmPosition = -1;
+	
+	FileIdentity identity;
+	
+	bool ok = get_file_identity(fp, path, &identity) && identity == _identity &&
+				open_decoder(&localRec, fp, path) == malNoError;
+	
+	FILE *f = (ok ? fopen_path(temp_path, "wb") : NULL);
+	
+	ok = (f != NULL);
+	
+	
+	const long block_samples = AudioCache::BLOCK_SAMPLES;
+	
+	ConformedHeader header;
+	
+	memset(&header, 0, sizeof(header));
+	
+	memcpy(header.magic, g_conformed_magic, sizeof(header.magic));
+	header.identity = _identity;
+	header.samples = 0; // until we know
+	header.channels = _numChannels;
+	header.block_samples = block_samples;
+	header.sample_rate = (ogg_int32_t)(_sampleRate + 0.5f);
+	
+	if(ok)
+		ok = (fwrite(&header, sizeof(header), 1, f) == 1);
+	
+	
+	// Don't bother with a file that won't fit in the cache, or in our address space
+	ogg_int64_t max_bytes = disk_cache_limit();
+	
+	if(sizeof(void *) < 8 && max_bytes > 512 * 1024 * 1024)
+		max_bytes = 512 * 1024 * 1024;
+	
+	const ogg_int64_t max_samples = (max_bytes - (ogg_int64_t)sizeof(header)) / (ogg_int64_t)(sizeof(float) * _numChannels);
+	
+	std::vector<float> block(block_samples * _numChannels);
+	
+	float *buffers[6];
+	
+	for(int c=0; c < _numChannels; c++)
+		buffers[c] = &block[c * block_samples];
+	
+	long decoded = block_samples;
+	
+	while(ok && decoded == block_samples && !cancelled())
+	{
+		ok = (decode_audio(&localRec, buffers, header.samples, block_samples, &decoded) == malNoError);
+		
+		for(int c=0; c < _numChannels && ok; c++)
+			ok = (fwrite(buffers[c], sizeof(float), decoded, f) == (size_t)decoded);
+		
+		header.samples += decoded;
+		
+		if(header.samples > max_samples)
+			ok = false;
+	}
+	
+	if(ok)
+		ok = (decoded < block_samples && header.samples > 0); // as opposed to cancelled
+	
+	if(ok)
+		ok = (fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1);
+	
+	if(f != NULL && fclose(f) != 0)
+		ok = false;
+	
+	close_decoder(&localRec);
+	
+	close_file(fp);
+	
+	return ok;
+}
 
 
-	// private data
-	assert(SDKFileInfo8->privatedata);
-	ImporterLocalRec8H ldataH = reinterpret_cast<ImporterLocalRec8H>(SDKFileInfo8->privatedata);
-	stdParms->piSuites->memFuncs->lockHandle(reinterpret_cast<char**>(ldataH));
-	ImporterLocalRec8Ptr localRecP = reinterpret_cast<ImporterLocalRec8Ptr>( *ldataH );
+static void
+delete_disk_builder(DiskCacheBuilder *builder)
+{
+	delete builder;
+}
 
 
-	SDKFileInfo8->hasVideo = kPrFalse;
-	SDKFileInfo8->hasAudio = kPrFalse;
+// Check on the disk cache for this clip, starting the builder if it's not there yet
+static ConformedAudio *
+get_conformed_audio(ImporterLocalRec8Ptr localRecP)
+{
+	if(localRecP->conformed != NULL || localRecP->diskCacheFailed)
+		return localRecP->conformed;
 	
+	if(disk_cache_limit() <= 0 || localRecP->identity.size <= 0 || localRecP->filePath == NULL)
+		return NULL;
 	
-	if(localRecP)
+	bool just_built = false;
+	
+	if(localRecP->diskBuilder != NULL)
 	{
-		if(localRecP->fileType == Ogg_filetype && localRecP->vf != NULL)
-		{
-			OggVorbis_File &vf = *localRecP->vf;
+		if( !localRecP->diskBuilder->finished() )
+			return NULL;
 		
-			vorbis_info *info = ov_info(&vf, 0);
-		
-			// Audio information
-			SDKFileInfo8->hasAudio				= kPrTrue;
-			SDKFileInfo8->audInfo.numChannels	= info->channels;
-			SDKFileInfo8->audInfo.sampleRate	= info->rate;
-			SDKFileInfo8->audInfo.sampleType	= kPrAudioSampleType_Compressed;
-													
-			SDKFileInfo8->audDuration			= ov_pcm_total(&vf, 0);
-		}
-		else if(localRecP->fileType == Opus_filetype && localRecP->opus != NULL)
-		{
-			SDKFileInfo8->hasAudio				= kPrTrue;
-			SDKFileInfo8->audInfo.numChannels	= op_channel_count(localRecP->opus, -1);
-			SDKFileInfo8->audInfo.sampleRate	= 48000; // Ogg Opus always uses 48 kHz
-			SDKFileInfo8->audInfo.sampleType	= kPrAudioSampleType_Compressed;
-													
-			SDKFileInfo8->audDuration			= op_pcm_total(localRecP->opus, -1);
-		}
-		else if(localRecP->fileType == FLAC_filetype && localRecP->flac != NULL)
-		{
-			try
-			{
-				SDKFileInfo8->hasAudio				= kPrTrue;
-				SDKFileInfo8->audInfo.numChannels	= localRecP->flac->get_channels();
-				SDKFileInfo8->audInfo.sampleRate	= localRecP->flac->get_sample_rate();
-				
-				int bitDepth = localRecP->flac->get_bits_per_sample();
-				
-				SDKFileInfo8->audInfo.sampleType	= bitDepth == 8 ? kPrAudioSampleType_8BitInt :
-														bitDepth == 16 ? kPrAudioSampleType_16BitInt :
-														bitDepth == 24 ? kPrAudioSampleType_24BitInt :
-														bitDepth == 32 ? kPrAudioSampleType_32BitInt :
-														bitDepth == 64 ? kPrAudioSampleType_64BitFloat :
-														kPrAudioSampleType_Compressed;
-														
-				SDKFileInfo8->audDuration			= localRecP->flac->get_total_samples();
-			}
-			catch(...)
-			{
-				result = imBadFile;
-			}
-		}
-
-		localRecP->audioSampleRate			= SDKFileInfo8->audInfo.sampleRate;
-		localRecP->numChannels				= SDKFileInfo8->audInfo.numChannels;
+		delete localRecP->diskBuilder;
 		
+		localRecP->diskBuilder = NULL;
 		
-		if(SDKFileInfo8->audInfo.numChannels > 2 && SDKFileInfo8->audInfo.numChannels != 6)
-		{
-			// Premiere can't handle anything but Mono, Stereo, and 5.1
-			result = imUnsupportedAudioFormat;
-		}
+		just_built = true;
 	}
+	
+	const PathString dir = disk_cache_dir();
+	
+	if( dir.empty() )
+	{
+		localRecP->diskCacheFailed = true;
 		
-	stdParms->piSuites->memFuncs->unlockHandle(reinterpret_cast<char**>(ldataH));
-
-	return result;
+		return NULL;
+	}
+	
+	localRecP->conformed = ConformedAudio::open(disk_cache_path(dir, localRecP->identity, "pcm"),
+												localRecP->identity, localRecP->numChannels);
+	
+	if(localRecP->conformed == NULL)
+	{
+		if(just_built)
+			localRecP->diskCacheFailed = true; // don't keep trying
+		else
+			localRecP->diskBuilder = DiskCacheBuilder::create(localRecP, dir);
+	}
+	
+	return localRecP->conformed;
 }
 
 
-
-
 static prMALError 
 SDKImportAudio7(
 	imStdParms			*stdParms, 
@@ -939,187 +3870,92 @@ SDKImportAudio7(
 
 	if(localRecP)
 	{
-		assert(audioRec7->position >= 0); // Do they really want contiguous samples?
+		// Premiere can call us for the same clip from more than one thread, so the
+		// clip's own bookkeeping happens under its lock, and the decoding doesn't
+		ogg_int64_t position = -1;
+		bool scrubbing = false;
 		
-		// for surround channels
-		// Premiere uses Left, Right, Left Rear, Right Rear, Center, LFE
-		// Ogg (and Opus) uses Left, Center, Right, Left Read, Right Rear, LFE
-		// http://www.xiph.org/vorbis/doc/Vorbis_I_spec.html#x1-800004.3.9
-		static const int surround_swizzle[] = {0, 2, 3, 4, 1, 5};
-		static const int stereo_swizzle[] = {0, 1, 2, 3, 4, 5}; // no swizzle, actually
+		ConformedAudio *conformed = NULL;
 		
-		const int *swizzle = localRecP->numChannels > 2 ? surround_swizzle : stereo_swizzle;
-		
-						
-		if(localRecP->fileType == Ogg_filetype && localRecP->vf != NULL)
 		{
-			OggVorbis_File &vf = *localRecP->vf;
+			ScopedLock lock(*localRecP->clipMutex);
 			
-			int seek_err = OV_OK;
-			
-			if(audioRec7->position >= 0) // otherwise contiguous, but we should be good at the current position
-				seek_err = ov_pcm_seek(&vf, audioRec7->position);
-				
+			// A negative position means Premiere wants the samples that follow the last request
+			position = (audioRec7->position >= 0 ? audioRec7->position : localRecP->requestEnds[localRecP->lastRequest]);
 			
-			if(seek_err == OV_OK)
+			if(position >= 0)
 			{
-				int num = 0;
-				float **pcm_channels;
+				// accurate playback picks up again as soon as a request follows one before
+				const bool jumped = !follow_request(localRecP, position, position + audioRec7->size);
 				
-				long samples_needed = audioRec7->size;
-				long pos = 0;
+				localRecP->scrubJumps = (jumped && audioRec7->size <= SCRUB_MAX_SAMPLES ? localRecP->scrubJumps + 1 : 0);
 				
-				while(samples_needed > 0 && result == malNoError)
-				{
-					int samples = samples_needed;
-					
-					if(samples > 1024)
-						samples = 1024; // maximum size this call can read at once
+				scrubbing = (localRecP->scrubJumps >= SCRUB_JUMPS && get_setting(SETTING_SCRUB, 1));
 				
-					long samples_read = ov_read_float(&vf, &pcm_channels, samples, &num);
+				conformed = get_conformed_audio(localRecP);
+				
+				if(conformed == NULL)
+				{
+					result = ensure_decoder(localRecP, SDKfileRef);
 					
-					if(samples_read >= 0)
+					if(result == malNoError)
 					{
-						if(samples_read == 0)
-						{
-							// EOF
-							// Premiere will keep asking me for more and more samples,
-							// even beyond what I told it I had in SDKFileInfo8->audDuration.
-							// Just stop and everything will be fine.
-							break;
-						}
-						
-						for(int i=0; i < localRecP->numChannels; i++)
+						// until there's a pool, nobody else has the decoder
+						if(localRecP->decoderPool == NULL)
 						{
-							memcpy(&audioRec7->buffer[i][pos], pcm_channels[swizzle[i]], samples_read * sizeof(float));
+							load_into_memory(localRecP, SDKfileRef);
+							
+							localRecP->decoderPool = new DecoderPool(get_setting(SETTING_CLIP_DECODERS, 4));
 						}
 						
-						samples_needed -= samples_read;
-						pos += samples_read;
+						adopt_seek_index(localRecP);
 					}
-					else
-						result = imDecompressionError;
 				}
 			}
 		}
-		else if(localRecP->fileType == Opus_filetype && localRecP->opus != NULL)
-		{
-			const int num_channels = op_channel_count(localRecP->opus, -1);
 		
-			assert(localRecP->numChannels == num_channels);
-			
-			
-			int seek_err = OV_OK;
-			
-			if(audioRec7->position >= 0) // otherwise contiguous, but we should be good at the current position
-				seek_err = op_pcm_seek(localRecP->opus, audioRec7->position);
-				
+		if(position >= 0 && result == malNoError)
+		{
+			long samples_read = 0;
 			
-			if(seek_err == OV_OK)
+			if(conformed != NULL)
 			{
-				float *pcm_buf = (float *)malloc(sizeof(float) * audioRec7->size * num_channels);
-				
-				if(pcm_buf != NULL)
-				{
-					long samples_needed = audioRec7->size;
-					long pos = 0;
-					
-					while(samples_needed > 0 && result == malNoError)
-					{
-						float *_pcm = &pcm_buf[pos * num_channels];
-						
-						int samples_read = op_read_float(localRecP->opus, _pcm, samples_needed * num_channels, NULL);
-						
-						if(samples_read == 0)
-						{
-							// guess we're at the end of the stream
-							break;
-						}
-						else if(samples_read < 0)
-						{
-							result = imDecompressionError;
-						}
-						else
-						{
-							for(int c=0; c < localRecP->numChannels; c++)
-							{
-								for(int i=0; i < samples_read; i++)
-								{
-									audioRec7->buffer[c][pos + i] = _pcm[(i * num_channels) + swizzle[c]];
-								}
-							}
-							
-							samples_needed -= samples_read;
-							pos += samples_read;
-						}
-					}
-					
-					free(pcm_buf);
-				}
+				samples_read = conformed->read(position, audioRec7->size, audioRec7->buffer);
 			}
-		}
-		else if(localRecP->fileType == FLAC_filetype && localRecP->flac != NULL)
-		{
-			try
+			else
 			{
-				//localRecP->flac->reset();
-				
-				assert(audioRec7->position >= 0); // not handling Premiere's continuous reads
-				
-				assert(localRecP->flac->get_channels() == localRecP->numChannels);
-				
-				
-				long samples_needed = audioRec7->size;
+				ImporterLocalRec8Ptr decoderRecP = localRecP->decoderPool->acquire(localRecP, position);
 				
+				const bool preview = (decoderRecP->opusPreview != NULL && audioRec7->size < PREVIEW_MAX_SAMPLES);
 				
-				localRecP->flac->set_buffers(audioRec7->buffer, samples_needed, audioRec7->position);
+				if(!preview)
+					set_preview_decode(decoderRecP, false);
 				
+				if(scrubbing)
+					result = scrub_audio(decoderRecP, audioRec7->buffer, position, audioRec7->size, &samples_read);
+				else if(preview)
+					result = preview_audio(decoderRecP, audioRec7->buffer, position, audioRec7->size, &samples_read);
+				else
+					result = parallel_import_audio(localRecP, decoderRecP, audioRec7->buffer, position, audioRec7->size, &samples_read);
 				
-				// Calling seek will cause flac to "write" some audio, of course!
-				bool sought = localRecP->flac->seek_absolute(audioRec7->position);
+				localRecP->decoderPool->release(decoderRecP);
 				
-				
-				bool eof = false;
-				
-				size_t buffer_position = 0;
-				
-				if(sought)
+				// get the next bit ready while Premiere plays this one
+				if(result == malNoError && !scrubbing && !preview && samples_read == audioRec7->size)
 				{
-					do{
-						size_t new_buffer_position = localRecP->flac->get_pos();
-						
-						int samples_read = (new_buffer_position - buffer_position);
-						
-						if(samples_read > 0)
-						{
-							samples_needed -= samples_read;
-						}
-						else
-							eof = true;
-							
-						buffer_position = new_buffer_position;
-						
-						if(samples_needed > 0 && !eof)
-						{
-							bool processed = localRecP->flac->process_single();
-							
-							if(!processed)
-								samples_needed = 0;
-						}
-							
-					}while(samples_needed > 0 && !eof);
+					ScopedLock lock(*localRecP->clipMutex);
+					
+					if(localRecP->readAhead == NULL)
+						localRecP->readAhead = ReadAhead::create(localRecP);
+					
+					if(localRecP->readAhead != NULL)
+						localRecP->readAhead->request(position + samples_read);
 				}
-				
-				localRecP->flac->set_buffers(NULL, 0, 0); // don't trust libflac not to write at inopportune times
-			}
-			catch(...)
-			{
-				result = imDecompressionError;
 			}
 		}
 	}
 	
-					
+				
 	stdParms->piSuites->memFuncs->unlockHandle(reinterpret_cast<char**>(ldataH));
 	
 	assert(result == malNoError);
@@ -1192,6 +4028,7 @@ PREMPLUGENTRY DllExport xImportEntry (
 											reinterpret_cast<imImportAudioRec7*>(param2));
 			break;
 
+		// The async importer is for video frames.  For audio, see ReadAhead.
 		case imCreateAsyncImporter:
 			result =	imUnsupported;
 			break;
@@ -1202,3 +4039,4 @@ PREMPLUGENTRY DllExport xImportEntry (
 	return result;
 }
 
+
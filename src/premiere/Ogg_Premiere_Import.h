@@ -84,7 +84,7 @@ typedef SInt16 FSIORefNum;
 typedef void * PrivateDataPtr;
 typedef csSDK_int32 RowbyteType;
 
-#ifdef PRMAC_ENV
+#ifndef PRWIN_ENV
 #define CAST_REFNUM(REFNUM)		reinterpret_cast<intptr_t>(REFNUM)
 #define CAST_FILEREF(FILEREF)	reinterpret_cast<imFileRef>(FILEREF)
 #else
@@ -0,0 +1,938 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Brendan Bolles
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// *	   Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// *	   Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+
+// ------------------------------------------------------------------------
+//
+// Threads, settings and file access for the Ogg importer
+//
+// by Brendan Bolles <brendan@fnordware.com>
+//
+// ------------------------------------------------------------------------
+
+
+#include "Ogg_Premiere_Platform.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef PRWIN_ENV
+#include <process.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __APPLE__
+#include <AvailabilityMacros.h>
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101000
+#include <pthread/qos.h>
+#endif
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+
+long
+get_setting(const char *name, long default_value)
+{
+#ifdef PRWIN_ENV
+	char value[64];
+	
+	DWORD len = GetEnvironmentVariableA(name, value, sizeof(value));
+	
+	if(len == 0 || len >= sizeof(value))
+		return default_value;
+#else
+	const char *value = getenv(name);
+	
+	if(value == NULL || *value == '\0')
+		return default_value;
+#endif
+
+	return strtol(value, NULL, 10);
+}
+
+
+// 16-byte aligned, for SSE and NEON
+void *
+aligned_malloc(size_t size)
+{
+#ifdef PRWIN_ENV
+	return _aligned_malloc(size, 16);
+#elif defined(PRMAC_ENV)
+	return malloc(size); // always 16-byte aligned on the Mac
+#else
+	void *ptr = NULL;
+	
+	return (posix_memalign(&ptr, 16, size) == 0 ? ptr : NULL);
+#endif
+}
+
+
+void
+aligned_free(void *ptr)
+{
+#ifdef PRWIN_ENV
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+
+#ifdef PRWIN_ENV
+Mutex::Mutex() { InitializeCriticalSection(&_cs); }
+Mutex::~Mutex() { DeleteCriticalSection(&_cs); }
+void Mutex::lock() { EnterCriticalSection(&_cs); }
+void Mutex::unlock() { LeaveCriticalSection(&_cs); }
+#else
+Mutex::Mutex() { pthread_mutex_init(&_mutex, NULL); }
+Mutex::~Mutex() { pthread_mutex_destroy(&_mutex); }
+void Mutex::lock() { pthread_mutex_lock(&_mutex); }
+void Mutex::unlock() { pthread_mutex_unlock(&_mutex); }
+#endif
+
+
+#ifdef PRWIN_ENV
+Event::Event() { _event = CreateEvent(NULL, FALSE, FALSE, NULL); }
+Event::~Event() { CloseHandle(_event); }
+void Event::signal() { SetEvent(_event); }
+void Event::wait() { WaitForSingleObject(_event, INFINITE); }
+#else
+Event::Event() : _signaled(false) { pthread_mutex_init(&_mutex, NULL); pthread_cond_init(&_cond, NULL); }
+Event::~Event() { pthread_cond_destroy(&_cond); pthread_mutex_destroy(&_mutex); }
+
+void
+Event::signal()
+{
+	pthread_mutex_lock(&_mutex);
+	
+	_signaled = true;
+	
+	pthread_cond_signal(&_cond);
+	
+	pthread_mutex_unlock(&_mutex);
+}
+
+void
+Event::wait()
+{
+	pthread_mutex_lock(&_mutex);
+	
+	while(!_signaled)
+		pthread_cond_wait(&_cond, &_mutex);
+	
+	_signaled = false;
+	
+	pthread_mutex_unlock(&_mutex);
+}
+#endif
+
+
+bool
+Thread::start(bool low_priority)
+{
+	assert(!_started);
+	
+	{
+		ScopedLock lock(_mutex);
+		
+		_finished = false; // in case we've run before
+	}
+	
+#ifdef PRWIN_ENV
+	_thread = (HANDLE)_beginthreadex(NULL, 0, entry, this, 0, NULL);
+	
+	_started = (_thread != NULL);
+	
+	if(_started && low_priority)
+		SetThreadPriority(_thread, THREAD_PRIORITY_LOWEST);
+#else
+	_low_priority = low_priority; // the thread does this one itself
+	
+	_started = (pthread_create(&_thread, NULL, entry, this) == 0);
+#endif
+
+	return _started;
+}
+
+
+void
+Thread::cancel()
+{
+	ScopedLock lock(_mutex);
+	
+	_cancel = true;
+}
+
+
+bool
+Thread::cancelled()
+{
+	ScopedLock lock(_mutex);
+	
+	return _cancel;
+}
+
+
+bool
+Thread::finished()
+{
+	ScopedLock lock(_mutex);
+	
+	return _finished;
+}
+
+
+#ifndef PRWIN_ENV
+// With the normal scheduling policy, every thread's sched_priority is the same, so
+// pthread_setschedparam() can't lower it.  What the schedulers do go by is QoS on
+// the Mac and nice on Linux, which is per thread there.
+static void
+lower_thread_priority()
+{
+#if defined(__APPLE__) && MAC_OS_X_VERSION_MAX_ALLOWED >= 101000
+	pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#elif defined(__APPLE__)
+	setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE); // older systems only have the disk side of it
+#elif defined(__linux__)
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 10);
+#endif
+}
+#endif
+
+
+void
+Thread::run_thread()
+{
+#ifndef PRWIN_ENV
+	if(_low_priority)
+		lower_thread_priority();
+#endif
+
+	run();
+	
+	ScopedLock lock(_mutex);
+	
+	_finished = true;
+}
+
+
+void
+Thread::join()
+{
+	if(_started)
+	{
+	#ifdef PRWIN_ENV
+		WaitForSingleObject(_thread, INFINITE);
+		
+		CloseHandle(_thread);
+	#else
+		pthread_join(_thread, NULL);
+	#endif
+	
+		_started = false;
+	}
+}
+
+
+#ifdef PRWIN_ENV
+unsigned __stdcall
+Thread::entry(void *arg)
+{
+	static_cast<Thread *>(arg)->run_thread();
+	
+	return 0;
+}
+#else
+void *
+Thread::entry(void *arg)
+{
+	static_cast<Thread *>(arg)->run_thread();
+	
+	return NULL;
+}
+#endif
+
+
+int
+cpu_count()
+{
+#ifdef PRWIN_ENV
+	SYSTEM_INFO info;
+	
+	GetSystemInfo(&info);
+	
+	const int count = info.dwNumberOfProcessors;
+#else
+	const int count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	return (count > 0 ? count : 1);
+}
+
+
+#pragma mark-
+
+
+// The codec libraries read the file in little pieces (libvorbisfile and opusfile ask for
+// a couple KB at a time, libFLAC not much more) and tell/seek constantly.  Going to the OS
+// for every one of those is slow, especially over a network, so the file is read through
+// a small cache of large, block-aligned chunks.  When the reads are sequential, each chunk
+// we read is bigger than the last one (up to a limit), which gives us read-ahead.
+
+bool
+read_file(imFileRef fp, ogg_int64_t offset, void *buf, size_t len, size_t *bytes_read)
+{
+#ifdef PRWIN_ENV
+	// on a handle opened for synchronous I/O, the OVERLAPPED struct just supplies the offset
+	OVERLAPPED overlapped;
+	memset(&overlapped, 0, sizeof(OVERLAPPED));
+	
+	overlapped.Offset = (offset & 0xffffffff);
+	overlapped.OffsetHigh = (offset >> 32);
+	
+	DWORD count = len, out = 0;
+	
+	BOOL result = ReadFile(fp, (LPVOID)buf, count, &out, &overlapped);
+	
+	*bytes_read = out;
+	
+	return (result || GetLastError() == ERROR_HANDLE_EOF);
+#elif defined(OGG_POSIX_IO)
+	const int fd = CAST_REFNUM(fp);
+	
+	size_t total = 0;
+	bool ok = true;
+	
+	while(total < len && ok)
+	{
+		ssize_t out = pread(fd, static_cast<char *>(buf) + total, len - total, offset + total);
+		
+		if(out > 0)
+			total += out;
+		else if(out == 0)
+			break; // EOF
+		else if(errno != EINTR)
+			ok = false;
+	}
+	
+	*bytes_read = total;
+	
+	return ok;
+#else
+	ByteCount count = len, out = 0;
+	
+	OSErr result = FSReadFork(CAST_REFNUM(fp), fsFromStart, offset, count, buf, &out);
+	
+	*bytes_read = out;
+	
+	return (result == noErr || result == eofErr);
+#endif
+}
+
+
+ogg_int64_t
+file_size(imFileRef fp)
+{
+#ifdef PRWIN_ENV
+	LARGE_INTEGER lpos;
+
+	BOOL result = GetFileSizeEx(fp, &lpos);
+	
+	return (result ? lpos.QuadPart : 0);
+#elif defined(OGG_POSIX_IO)
+	struct stat st;
+	
+	int result = fstat(CAST_REFNUM(fp), &st);
+	
+	return (result == 0 ? st.st_size : 0);
+#else
+	SInt64 fork_size = 0;
+	
+	OSErr result = FSGetForkSize(CAST_REFNUM(fp), &fork_size);
+	
+	return (result == noErr ? fork_size : 0);
+#endif
+}
+
+
+#ifndef PRWIN_ENV
+bool
+posix_path(const prUTF16Char *path, char *buf, size_t buf_len)
+{
+#ifdef PRMAC_ENV
+	bool ok = false;
+	
+	CFStringRef filePathCFSR = CFStringCreateWithCharacters(NULL, path, prUTF16CharLength(path));
+	
+	CFURLRef filePathURL = CFURLCreateWithFileSystemPath(NULL, filePathCFSR, kCFURLPOSIXPathStyle, false);
+	
+	if(filePathURL != NULL)
+	{
+		ok = CFURLGetFileSystemRepresentation(filePathURL, true, (UInt8 *)buf, buf_len);
+		
+		CFRelease(filePathURL);
+	}
+	
+	CFRelease(filePathCFSR);
+	
+	return ok;
+#else
+	// UTF-16 to UTF-8
+	size_t len = 0;
+	
+	while(*path)
+	{
+		unsigned int c = *path++;
+		
+		if(c >= 0xd800 && c < 0xdc00 && *path >= 0xdc00 && *path < 0xe000)
+			c = 0x10000 + ((c - 0xd800) << 10) + (*path++ - 0xdc00);
+		
+		const size_t bytes = (c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4);
+		
+		if(len + bytes >= buf_len)
+			return false;
+		
+		if(bytes == 1)
+		{
+			buf[len++] = c;
+		}
+		else
+		{
+			static const unsigned char lead[] = { 0x00, 0x00, 0xc0, 0xe0, 0xf0 };
+			
+			for(size_t i = bytes - 1; i > 0; i--)
+			{
+				buf[len + i] = 0x80 | (c & 0x3f);
+				c >>= 6;
+			}
+			
+			buf[len] = lead[bytes] | c;
+			
+			len += bytes;
+		}
+	}
+	
+	buf[len] = '\0';
+	
+	return true;
+#endif
+}
+#endif // !PRWIN_ENV
+
+
+imFileRef
+open_file(const prUTF16Char *path)
+{
+#ifdef PRWIN_ENV
+	HANDLE fileH = CreateFileW(path,
+								GENERIC_READ,
+								FILE_SHARE_READ,
+								NULL,
+								OPEN_EXISTING,
+								FILE_ATTRIBUTE_NORMAL,
+								NULL);
+	
+	return (fileH != INVALID_HANDLE_VALUE ? fileH : imInvalidHandleValue);
+#elif defined(OGG_POSIX_IO)
+	char file_path[PATH_MAX];
+	
+	int fd = -1;
+	
+	if( posix_path(path, file_path, PATH_MAX) )
+		fd = open(file_path, O_RDONLY);
+	
+	return (fd >= 0 ? CAST_FILEREF((intptr_t)fd) : imInvalidHandleValue);
+#else
+	FSIORefNum refNum = CAST_REFNUM(imInvalidHandleValue);
+			
+	CFStringRef filePathCFSR = CFStringCreateWithCharacters(NULL, path, prUTF16CharLength(path));
+												
+	CFURLRef filePathURL = CFURLCreateWithFileSystemPath(NULL, filePathCFSR, kCFURLPOSIXPathStyle, false);
+	
+	if(filePathURL != NULL)
+	{
+		FSRef fileRef;
+		Boolean success = CFURLGetFSRef(filePathURL, &fileRef);
+		
+		if(success)
+		{
+			HFSUniStr255 dataForkName;
+			FSGetDataForkName(&dataForkName);
+		
+			FSOpenFork(	&fileRef,
+						dataForkName.length,
+						dataForkName.unicode,
+						fsRdPerm,
+						&refNum);
+		}
+									
+		CFRelease(filePathURL);
+	}
+								
+	CFRelease(filePathCFSR);
+	
+	return CAST_FILEREF(refNum);
+#endif
+}
+
+
+void
+close_file(imFileRef fp)
+{
+#ifdef PRWIN_ENV
+	CloseHandle(fp);
+#elif defined(OGG_POSIX_IO)
+	close(CAST_REFNUM(fp));
+#else
+	FSCloseFork( CAST_REFNUM(fp) );
+#endif
+}
+
+
+// for threads that open the file themselves
+void
+copy_path(const prUTF16Char *path, std::vector<prUTF16Char> &copy)
+{
+	size_t len = 0;
+	
+	while(path[len] != 0)
+		len++;
+	
+	copy.assign(path, path + len + 1);
+}
+
+
+
+bool
+get_env_path(const char *name, PathString &value)
+{
+#ifdef PRWIN_ENV
+	const std::wstring wide_name(name, name + strlen(name)); // names are all ASCII
+	
+	wchar_t buf[MAX_PATH];
+	
+	DWORD len = GetEnvironmentVariableW(wide_name.c_str(), buf, MAX_PATH);
+	
+	if(len == 0 || len >= MAX_PATH)
+		return false;
+	
+	value = buf;
+#else
+	const char *env = getenv(name);
+	
+	if(env == NULL || *env == '\0')
+		return false;
+	
+	value = env;
+#endif
+
+	return true;
+}
+
+
+
+bool
+get_file_identity(imFileRef fp, const prUTF16Char *path, FileIdentity *identity)
+{
+	// FNV-1a
+	ogg_uint64_t hash = 0xcbf29ce484222325ULL;
+	
+	for(const prUTF16Char *c = path; *c != 0; c++)
+	{
+		hash ^= (*c & 0xff);
+		hash *= 0x100000001b3ULL;
+		hash ^= (*c >> 8);
+		hash *= 0x100000001b3ULL;
+	}
+	
+	identity->path_hash = hash;
+	identity->size = file_size(fp);
+	identity->modified = 0;
+	
+#ifdef PRWIN_ENV
+	FILETIME write_time;
+	
+	if( GetFileTime(fp, NULL, NULL, &write_time) )
+		identity->modified = ((ogg_int64_t)write_time.dwHighDateTime << 32) | write_time.dwLowDateTime;
+	else
+		return false;
+#else
+	struct stat st;
+	
+#ifdef OGG_POSIX_IO
+	int stat_err = fstat(CAST_REFNUM(fp), &st);
+#else
+	char file_path[PATH_MAX];
+	
+	int stat_err = (posix_path(path, file_path, PATH_MAX) ? stat(file_path, &st) : -1);
+#endif
+
+	if(stat_err == 0)
+		identity->modified = st.st_mtime;
+	else
+		return false;
+#endif
+
+	return true;
+}
+
+
+BlockCache::BlockCache(imFileRef fp) :
+	_fp(fp),
+	_size( file_size(fp) ),
+	_clock(0),
+	_next_offset(-1),
+	_read_size(BLOCK_SIZE)
+{
+	for(int i=0; i < NUM_CHUNKS; i++)
+	{
+		_chunks[i].offset = -1;
+		_chunks[i].length = 0;
+		_chunks[i].last_used = 0;
+		_chunks[i].data = NULL;
+	}
+}
+
+
+BlockCache::~BlockCache()
+{
+	for(int i=0; i < NUM_CHUNKS; i++)
+	{
+		if(_chunks[i].data != NULL)
+			free(_chunks[i].data);
+	}
+}
+
+
+size_t
+BlockCache::read(ogg_int64_t offset, void *buf, size_t len)
+{
+	unsigned char *out = static_cast<unsigned char *>(buf);
+	
+	size_t total = 0;
+	
+	while(total < len && offset < _size)
+	{
+		const Chunk *chunk = fetch(offset);
+		
+		if(chunk == NULL)
+			break;
+		
+		const size_t chunk_pos = (offset - chunk->offset);
+		
+		if(chunk_pos >= chunk->length)
+			break; // file got shorter?
+		
+		size_t count = chunk->length - chunk_pos;
+		
+		if(count > (len - total))
+			count = (len - total);
+		
+		memcpy(out + total, chunk->data + chunk_pos, count);
+		
+		total += count;
+		offset += count;
+	}
+	
+	return total;
+}
+
+
+const BlockCache::Chunk *
+BlockCache::fetch(ogg_int64_t offset)
+{
+	_clock++;
+	
+	for(int i=0; i < NUM_CHUNKS; i++)
+	{
+		Chunk &chunk = _chunks[i];
+	
+		if(chunk.data != NULL && offset >= chunk.offset && offset < (chunk.offset + (ogg_int64_t)chunk.length))
+		{
+			chunk.last_used = _clock;
+			
+			return &chunk;
+		}
+	}
+	
+	
+	const ogg_int64_t block_offset = offset - (offset % BLOCK_SIZE);
+	
+	// if we're picking up where the last read ended, the reads get bigger
+	if(block_offset == _next_offset)
+	{
+		_read_size *= 2;
+		
+		if(_read_size > MAX_READ)
+			_read_size = MAX_READ;
+	}
+	else
+		_read_size = BLOCK_SIZE;
+	
+	
+	Chunk *oldest = &_chunks[0];
+	
+	for(int i=1; i < NUM_CHUNKS; i++)
+	{
+		if(_chunks[i].last_used < oldest->last_used)
+			oldest = &_chunks[i];
+	}
+	
+	if(oldest->data == NULL)
+	{
+		oldest->data = (unsigned char *)malloc(MAX_READ);
+		
+		if(oldest->data == NULL)
+			return NULL;
+	}
+	
+	size_t bytes_read = 0;
+	
+	bool ok = read_file(_fp, block_offset, oldest->data, _read_size, &bytes_read);
+	
+	if(!ok || bytes_read == 0)
+	{
+		oldest->offset = -1;
+		oldest->length = 0;
+		
+		return NULL;
+	}
+	
+	oldest->offset = block_offset;
+	oldest->length = bytes_read;
+	oldest->last_used = _clock;
+	
+	_next_offset = block_offset + bytes_read;
+	
+	return oldest;
+}
+
+
+size_t
+SharedSource::read(ogg_int64_t offset, void *buf, size_t len)
+{
+	if(offset < 0 || offset >= _size)
+		return 0;
+	
+	if((ogg_int64_t)len > _size - offset)
+		len = _size - offset;
+	
+	memcpy(buf, _data + offset, len);
+	
+	return len;
+}
+
+
+MemorySource *
+MemorySource::load(imFileRef fp)
+{
+	const ogg_int64_t size = file_size(fp);
+	
+	if(size <= 0 || size != (ogg_int64_t)(size_t)size)
+		return NULL;
+	
+	unsigned char *data = (unsigned char *)malloc(size);
+	
+	if(data == NULL)
+		return NULL;
+	
+	size_t bytes_read = 0;
+	
+	bool ok = read_file(fp, 0, data, size, &bytes_read);
+	
+	if(!ok || (ogg_int64_t)bytes_read != size)
+	{
+		free(data);
+		
+		return NULL;
+	}
+	
+	return new MemorySource(data, size, false);
+}
+
+
+MemorySource *
+MemorySource::map(imFileRef fp, const prUTF16Char *path)
+{
+	const ogg_int64_t size = file_size(fp);
+	
+	if(size <= 0 || size != (ogg_int64_t)(size_t)size)
+		return NULL;
+	
+	void *data = NULL;
+	
+#ifdef PRWIN_ENV
+	(void)path; // Windows can map the handle we already have
+	
+	HANDLE mapping = CreateFileMappingW(fp, NULL, PAGE_READONLY, 0, 0, NULL);
+	
+	if(mapping != NULL)
+	{
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		
+		CloseHandle(mapping); // the view keeps the mapping alive
+	}
+#else
+	// open our own descriptor, in case fp is a fork refNum
+	char file_path[PATH_MAX];
+	
+	if( posix_path(path, file_path, PATH_MAX) )
+		return map(file_path);
+#endif
+
+	return (data != NULL ? new MemorySource(static_cast<unsigned char *>(data), size, true) : NULL);
+}
+
+
+MemorySource *
+MemorySource::map(const PathString &path)
+{
+	void *data = NULL;
+	ogg_int64_t size = 0;
+	
+#ifdef PRWIN_ENV
+	HANDLE fileH = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+								NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	
+	if(fileH != INVALID_HANDLE_VALUE)
+	{
+		size = file_size(fileH);
+		
+		HANDLE mapping = (size > 0 && size == (ogg_int64_t)(size_t)size) ? CreateFileMappingW(fileH, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+		
+		if(mapping != NULL)
+		{
+			data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			
+			CloseHandle(mapping);
+		}
+		
+		CloseHandle(fileH);
+	}
+#else
+	int fd = open(path.c_str(), O_RDONLY);
+	
+	if(fd >= 0)
+	{
+		struct stat st;
+		
+		if(fstat(fd, &st) == 0)
+			size = st.st_size;
+		
+		if(size > 0 && size == (ogg_int64_t)(size_t)size)
+		{
+			data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			
+			if(data == MAP_FAILED)
+				data = NULL;
+		}
+		
+		close(fd); // the mapping stays valid
+	}
+#endif
+
+	return (data != NULL ? new MemorySource(static_cast<unsigned char *>(data), size, true) : NULL);
+}
+
+
+MemorySource::~MemorySource()
+{
+	if(_mapped)
+	{
+	#ifdef PRWIN_ENV
+		UnmapViewOfFile(_data);
+	#else
+		munmap(_data, _size);
+	#endif
+	}
+	else
+		free(_data);
+}
+
+
+size_t
+MemorySource::read(ogg_int64_t offset, void *buf, size_t len)
+{
+	if(offset >= (ogg_int64_t)_size)
+		return 0;
+	
+	size_t count = _size - offset;
+	
+	if(count > len)
+		count = len;
+	
+	memcpy(buf, _data + offset, count);
+	
+	return count;
+}
+
+
+FileSource *
+create_source(imFileRef fp, const prUTF16Char *path)
+{
+	FileSource *source = NULL;
+	
+	const ogg_int64_t size = file_size(fp);
+	
+	const ogg_int64_t ram_limit = (ogg_int64_t)get_setting(SETTING_RAM_FILE_MB, 16) * 1024 * 1024;
+	
+	if(size > ram_limit && get_setting(SETTING_MAP_FILES, 0))
+	{
+		// Off by default because if a mapped file goes away (say the network drops),
+		// we get an access violation instead of a read error.
+		source = MemorySource::map(fp, path);
+	}
+	
+	if(source == NULL)
+		source = new BlockCache(fp);
+	
+	return source;
+}
+
+
+FileSource *
+load_source(imFileRef fp)
+{
+	const ogg_int64_t size = file_size(fp);
+	
+	const ogg_int64_t ram_limit = (ogg_int64_t)get_setting(SETTING_RAM_FILE_MB, 16) * 1024 * 1024;
+	
+	return (size <= ram_limit ? MemorySource::load(fp) : NULL);
+}
@@ -0,0 +1,360 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Brendan Bolles
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// *	   Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// *	   Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+
+// ------------------------------------------------------------------------
+//
+// Threads, settings and file access for the Ogg importer
+//
+// by Brendan Bolles <brendan@fnordware.com>
+//
+// ------------------------------------------------------------------------
+
+
+// The plumbing the importer, its caches and its seek index all share.
+// Include this first, so that _FILE_OFFSET_BITS comes before any system header.
+
+
+#ifndef OGG_PREMIERE_PLATFORM_H
+#define OGG_PREMIERE_PLATFORM_H
+
+#if !defined(PRWIN_ENV) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS	64 // so pread() takes 64-bit offsets on 32-bit systems
+#endif
+
+#include "Ogg_Premiere_Import.h"
+
+#include <ogg/ogg.h>
+
+#include <assert.h>
+
+// File I/O uses Win32 on Windows and the Carbon File Manager on the Mac.  Anywhere else,
+// or on the Mac when OGG_POSIX_IO is defined, we use POSIX file descriptors and pread().
+#if !defined(PRWIN_ENV) && !defined(PRMAC_ENV) && !defined(OGG_POSIX_IO)
+#define OGG_POSIX_IO
+#endif
+
+#ifndef PRWIN_ENV
+#include <pthread.h>
+#endif
+
+#include <string>
+#include <vector>
+
+
+// Tuning knobs.  Each has a default where it's used, which can be overridden by setting
+// an environment variable with the same name.
+#define SETTING_RAM_FILE_MB		"OGG_IMPORT_RAM_FILE_MB"	// clips this size or smaller are read into RAM once audio is wanted (16)
+#define SETTING_MAP_FILES		"OGG_IMPORT_MAP_FILES"		// memory-map clips that are too big for RAM (0)
+#define SETTING_CACHE_MB		"OGG_IMPORT_CACHE_MB"		// decoded audio to keep around, for all clips together (256)
+#define SETTING_PACKED_CACHE_MB	"OGG_IMPORT_PACKED_CACHE_MB"	// more audio, packed into integers (256)
+#define SETTING_DISK_CACHE_MB	"OGG_IMPORT_DISK_CACHE_MB"	// decode clips to float files on disk, 0 to turn off (0)
+#define SETTING_CACHE_DIR		"OGG_IMPORT_CACHE_DIR"		// where those go (a folder in the user's cache location)
+#define SETTING_INFO_CACHE		"OGG_IMPORT_INFO_CACHE"		// remember clip info there too, so opening projects is fast (1)
+#define SETTING_SEEK_INDEX		"OGG_IMPORT_SEEK_INDEX"		// index pages and frames for seeking, and keep big ones there (1)
+#define SETTING_DECODE_THREADS	"OGG_IMPORT_DECODE_THREADS"	// decoders to split big requests across, 0 for one per core (0)
+#define SETTING_CLIP_DECODERS	"OGG_IMPORT_CLIP_DECODERS"	// decoders each clip can keep open for requests in different places (4)
+#define SETTING_READ_AHEAD		"OGG_IMPORT_READ_AHEAD"		// seconds to decode ahead of playback in the background, 0 for none (5)
+#define SETTING_SCRUB			"OGG_IMPORT_SCRUB"			// quick, approximate audio when it looks like we're being scrubbed (1)
+#define SETTING_FAST_PREVIEW	"OGG_IMPORT_FAST_PREVIEW"	// decode Opus at half rate for playback, not renders (0)
+#define SETTING_WARM_REOPEN		"OGG_IMPORT_WARM_REOPEN"	// decoders to keep when Premiere closes their files, so reopening is quick, 0 for none (16)
+#define SETTING_LAZY_OPEN		"OGG_IMPORT_LAZY_OPEN"		// read just the first and last pages when importing, open the decoder later (0)
+
+long get_setting(const char *name, long default_value);
+
+
+// 16-byte aligned, for SSE and NEON
+void * aligned_malloc(size_t size);
+void aligned_free(void *ptr);
+
+
+// Premiere can call us from more than one thread, and some of our data is shared
+class Mutex
+{
+  public:
+	Mutex();
+	~Mutex();
+	
+	void lock();
+	void unlock();
+	
+  private:
+#ifdef PRWIN_ENV
+	CRITICAL_SECTION _cs;
+#else
+	pthread_mutex_t _mutex;
+#endif
+};
+
+
+class ScopedLock
+{
+  public:
+	ScopedLock(Mutex &mutex) : _mutex(mutex) { _mutex.lock(); }
+	~ScopedLock() { _mutex.unlock(); }
+	
+  private:
+	Mutex &_mutex;
+};
+
+
+// For a thread to sleep on until there's something to do.  A signal() while nobody's
+// waiting is remembered, so the next wait() returns right away.
+class Event
+{
+  public:
+	Event();
+	~Event();
+	
+	void signal();
+	void wait();
+	
+  private:
+#ifdef PRWIN_ENV
+	HANDLE _event;
+#else
+	pthread_mutex_t _mutex;
+	pthread_cond_t _cond;
+	bool _signaled;
+#endif
+};
+
+
+// For work we do in the background.  Subclasses have to join() before they're destroyed,
+// since run() can't be called on an object that's half gone.  Once joined, a thread
+// can be started again.
+class Thread
+{
+  public:
+	Thread() : _started(false), _low_priority(false), _cancel(false), _finished(false) {}
+	virtual ~Thread() { assert(!_started); }
+	
+	bool start(bool low_priority = false);
+	void join();
+	
+	void cancel(); // run() should notice and return early
+	bool cancelled();
+	
+	bool finished(); // run() has returned
+	
+  protected:
+	virtual void run() = 0;
+	
+  private:
+#ifdef PRWIN_ENV
+	static unsigned __stdcall entry(void *arg);
+	
+	HANDLE _thread;
+#else
+	static void * entry(void *arg);
+	
+	pthread_t _thread;
+#endif
+	bool _started;
+	bool _low_priority;
+	
+	Mutex _mutex;
+	bool _cancel;
+	bool _finished;
+	
+	void run_thread();
+};
+
+
+int cpu_count();
+
+
+#pragma mark-
+
+
+bool read_file(imFileRef fp, ogg_int64_t offset, void *buf, size_t len, size_t *bytes_read);
+ogg_int64_t file_size(imFileRef fp);
+
+imFileRef open_file(const prUTF16Char *path);
+void close_file(imFileRef fp);
+
+#ifndef PRWIN_ENV
+// the path as the POSIX calls want it
+bool posix_path(const prUTF16Char *path, char *buf, size_t buf_len);
+#endif
+
+// for threads that open the file themselves
+void copy_path(const prUTF16Char *path, std::vector<prUTF16Char> &copy);
+
+
+// Paths to our own files (in the disk cache) are wide on Windows so that non-ASCII
+// user names work, UTF-8 everywhere else.
+#ifdef PRWIN_ENV
+typedef std::wstring PathString;
+#define PATH_SEPARATOR	L'\\'
+#else
+typedef std::string PathString;
+#define PATH_SEPARATOR	'/'
+#endif
+
+
+bool get_env_path(const char *name, PathString &value);
+
+
+// Tells us if two importer instances have the same file open, or if a file has
+// changed since we last saw it.
+typedef struct
+{
+	ogg_uint64_t	path_hash;
+	ogg_int64_t		size;
+	ogg_int64_t		modified;	// in whatever units the platform gives us
+} FileIdentity;
+
+
+inline bool
+operator < (const FileIdentity &a, const FileIdentity &b)
+{
+	return (a.path_hash != b.path_hash ? a.path_hash < b.path_hash :
+			a.size != b.size ? a.size < b.size :
+			a.modified < b.modified);
+}
+
+
+inline bool
+operator == (const FileIdentity &a, const FileIdentity &b)
+{
+	return (a.path_hash == b.path_hash && a.size == b.size && a.modified == b.modified);
+}
+
+
+bool get_file_identity(imFileRef fp, const prUTF16Char *path, FileIdentity *identity);
+
+
+// Where a FileStream gets its bytes from
+class FileSource
+{
+  public:
+	virtual ~FileSource() {}
+	
+	virtual size_t read(ogg_int64_t offset, void *buf, size_t len) = 0;
+	
+	virtual ogg_int64_t get_size() const = 0;
+	
+	// non-NULL if the entire file is sitting in memory
+	virtual const unsigned char * get_data() const { return NULL; }
+};
+
+
+// Reads the file through a few big, block-aligned chunks
+class BlockCache : public FileSource
+{
+  public:
+	BlockCache(imFileRef fp);
+	virtual ~BlockCache();
+	
+	virtual size_t read(ogg_int64_t offset, void *buf, size_t len);
+	
+	virtual ogg_int64_t get_size() const { return _size; }
+	
+  private:
+	enum {
+		BLOCK_SIZE	= 64 * 1024,	// all reads are aligned to this
+		MAX_READ	= 512 * 1024,	// biggest read-ahead
+		NUM_CHUNKS	= 4
+	};
+	
+	typedef struct {
+		ogg_int64_t		offset;
+		size_t			length;
+		unsigned int	last_used;
+		unsigned char	*data;
+	} Chunk;
+	
+	const Chunk * fetch(ogg_int64_t offset);
+	
+	imFileRef _fp;
+	ogg_int64_t _size;
+	
+	Chunk _chunks[NUM_CHUNKS];
+	unsigned int _clock;
+	
+	ogg_int64_t _next_offset; // where the last read left off
+	size_t _read_size;
+};
+
+
+// The whole file in memory, either mapped or read in.  Small clips get read in
+// completely once audio is wanted, so seeking around in them never touches the disk again.
+class MemorySource : public FileSource
+{
+  public:
+	static MemorySource * load(imFileRef fp);
+	static MemorySource * map(imFileRef fp, const prUTF16Char *path);
+	static MemorySource * map(const PathString &path);
+	
+	virtual ~MemorySource();
+	
+	virtual size_t read(ogg_int64_t offset, void *buf, size_t len);
+	
+	virtual ogg_int64_t get_size() const { return _size; }
+	
+	virtual const unsigned char * get_data() const { return _data; }
+	
+  private:
+	MemorySource(unsigned char *data, size_t size, bool mapped) : _data(data), _size(size), _mapped(mapped) {}
+	
+	unsigned char *_data;
+	size_t _size;
+	bool _mapped;
+};
+
+
+// Another decoder's file that's in memory, which any number of threads can read at once.
+// Doesn't own it.
+class SharedSource : public FileSource
+{
+  public:
+	SharedSource(const FileSource *source) : _data(source->get_data()), _size(source->get_size()) { assert(_data != NULL); }
+	virtual ~SharedSource() {}
+	
+	virtual size_t read(ogg_int64_t offset, void *buf, size_t len);
+	
+	virtual ogg_int64_t get_size() const { return _size; }
+	
+	virtual const unsigned char * get_data() const { return _data; }
+	
+  private:
+	const unsigned char *_data;
+	const ogg_int64_t _size;
+};
+
+
+// A BlockCache, or the file mapped if it's too big for RAM and we were asked to
+FileSource * create_source(imFileRef fp, const prUTF16Char *path);
+
+// The whole file read into memory, or NULL if it's too big for that
+FileSource * load_source(imFileRef fp);
+
+
+#endif // OGG_PREMIERE_PLATFORM_H
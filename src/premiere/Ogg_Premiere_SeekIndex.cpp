@@ -0,0 +1,725 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Brendan Bolles
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// *	   Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// *	   Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+
+// ------------------------------------------------------------------------
+//
+// Seek index for the Ogg importer
+//
+// by Brendan Bolles <brendan@fnordware.com>
+//
+// ------------------------------------------------------------------------
+
+
+#include "Ogg_Premiere_SeekIndex.h"
+
+#include "Ogg_Premiere_Cache.h"
+
+#include "FLAC/format.h"
+
+#include <string.h>
+
+#include <set>
+
+
+void
+SeekIndex::add(ogg_int64_t sample, ogg_int64_t offset)
+{
+	if(_count > 0 && (sample < _last.sample + _spacing || offset <= _last.offset))
+		return;
+	
+	if(sample < _last.sample || offset < _last.offset)
+		return; // negative deltas would be bad
+	
+	ogg_uint64_t deltas[2] = { (ogg_uint64_t)(sample - _last.sample), (ogg_uint64_t)(offset - _last.offset) };
+	
+	for(int i=0; i < 2; i++)
+	{
+		ogg_uint64_t val = deltas[i];
+		
+		while(val >= 0x80)
+		{
+			_data.push_back( (val & 0x7f) | 0x80 );
+			val >>= 7;
+		}
+		
+		_data.push_back(val);
+	}
+	
+	_last.sample = sample;
+	_last.offset = offset;
+	
+	if(_count % CHECKPOINT_INTERVAL == 0)
+	{
+		Checkpoint checkpoint = { _last, _data.size() };
+		
+		_checkpoints.push_back(checkpoint);
+	}
+	
+	_count++;
+}
+
+
+// point comes in as the previous one
+bool
+SeekIndex::read_point(const std::vector<unsigned char> &data, size_t *pos, Point *point)
+{
+	ogg_uint64_t deltas[2] = { 0, 0 };
+	
+	for(int i=0; i < 2; i++)
+	{
+		int shift = 0;
+		
+		while(true)
+		{
+			if(*pos >= data.size() || shift > 63)
+				return false;
+			
+			const unsigned char byte = data[(*pos)++];
+			
+			deltas[i] |= (ogg_uint64_t)(byte & 0x7f) << shift;
+			
+			if( !(byte & 0x80) )
+				break;
+			
+			shift += 7;
+		}
+	}
+	
+	point->sample += deltas[0];
+	point->offset += deltas[1];
+	
+	return true;
+}
+
+
+
+SeekIndex *
+SeekIndex::resume_scan(SeekIndex **resume, ogg_int64_t spacing)
+{
+	SeekIndex *index = NULL;
+	
+	if(resume != NULL)
+	{
+		index = *resume;
+		
+		*resume = NULL;
+		
+		if(index != NULL && index->_count == 0)
+		{
+			delete index;
+			
+			index = NULL;
+		}
+	}
+	
+	return (index != NULL ? index : new SeekIndex(spacing));
+}
+
+
+SeekIndex *
+SeekIndex::scan_ogg(FileSource *source, ogg_int64_t spacing, Thread *thread, SeekIndex **resume)
+{
+	SeekIndex *index = resume_scan(resume, spacing);
+	
+	int pages = 0;
+	
+	const ogg_int64_t size = source->get_size();
+	
+	ogg_int64_t offset = 0;
+	ogg_int64_t last_granule = -1;
+	
+	unsigned char header[27 + 255];
+	
+	// every page has to be from the first one's stream
+	if(source->read(0, header, 27) != 27 || memcmp(header, "OggS", 4) != 0)
+	{
+		delete index;
+		
+		return NULL;
+	}
+	
+	const ogg_uint32_t serial = read_le32(&header[14]);
+	
+	if(index->_count > 0)
+	{
+		// start again at the last page we kept, whose audio starts at the point's sample
+		offset = index->_last.offset;
+		last_granule = index->_last.sample;
+	}
+	
+	while(offset < size)
+	{
+		if(thread != NULL && (++pages % 256) == 0 && thread->cancelled())
+		{
+			if(resume != NULL)
+				*resume = index;
+			else
+				delete index;
+			
+			return NULL;
+		}
+		
+		if(source->read(offset, header, 27) != 27)
+			break;
+		
+		if(memcmp(header, "OggS", 4) != 0 || header[4] != 0)
+		{
+			// lost sync, which we shouldn't in a file libogg is happy with
+			delete index;
+			
+			return NULL;
+		}
+		
+		const int segments = header[26];
+		
+		if(source->read(offset + 27, header + 27, segments) != (size_t)segments)
+			break;
+		
+		int body = 0;
+		
+		for(int i=0; i < segments; i++)
+			body += header[27 + i];
+		
+		const ogg_int64_t granule = read_le64(&header[6]);
+		
+		if(read_le32(&header[14]) != serial)
+		{
+			// chained or multiplexed, so granules don't tell the whole story
+			delete index;
+			
+			return NULL;
+		}
+		
+		if(granule != -1) // -1 means no packet ends on this page
+		{
+			// the audio from this page picks up where the last one with a granule left off
+			if(last_granule >= 0)
+				index->add(last_granule, offset);
+			
+			last_granule = granule;
+		}
+		
+		offset += 27 + segments + body;
+	}
+	
+	return index;
+}
+
+
+
+// Where "fLaC" should be, given the first 10 bytes of the file.  Some files have an
+// ID3v2 tag in front, which libFLAC skips, so we do too.
+ogg_int64_t
+flac_start(const unsigned char *head)
+{
+	if(memcmp(head, "ID3", 3) != 0)
+		return 0;
+	
+	ogg_int64_t offset = 10 + ((head[6] & 0x7f) << 21 | (head[7] & 0x7f) << 14 | (head[8] & 0x7f) << 7 | (head[9] & 0x7f));
+	
+	if(head[5] & 0x10)
+		offset += 10; // footer
+	
+	return offset;
+}
+
+
+static FLAC__uint8
+flac_crc8(const unsigned char *data, int len)
+{
+	FLAC__uint8 crc = 0;
+	
+	while(len--)
+	{
+		crc ^= *data++;
+		
+		for(int i=0; i < 8; i++)
+			crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+	}
+	
+	return crc;
+}
+
+
+// Parse a FLAC frame header, returning its length, or 0 if it isn't one.
+// The 8-bit CRC will let through plenty of junk in a big file, so the header
+// also has to agree with STREAMINFO about the channels and bit depth.
+static int
+parse_flac_frame_header(const unsigned char *p, int len, unsigned fixed_blocksize,
+						int channels, int bits, ogg_int64_t *sample)
+{
+	if(len < 16 || p[0] != 0xff || (p[1] & 0xfe) != 0xf8)
+		return 0;
+	
+	const bool variable = (p[1] & 0x01);
+	const int blocksize_code = (p[2] >> 4);
+	const int rate_code = (p[2] & 0x0f);
+	const int channel_code = (p[3] >> 4);
+	const int size_code = ((p[3] >> 1) & 0x07);
+	
+	if(blocksize_code == 0 || rate_code == 15 || channel_code > 10 || (p[3] & 0x01))
+		return 0;
+	
+	static const int size_bits[] = { 0, 8, 12, -1, 16, 20, 24, 32 }; // 0 means "see STREAMINFO"
+	
+	if((channel_code < 8 ? channel_code + 1 : 2) != channels ||
+		(size_code != 0 && size_bits[size_code] != bits))
+		return 0;
+	
+	// sample or frame number, UTF-8 style
+	int pos = 4;
+	
+	int extra = 0;
+	ogg_uint64_t number = p[pos];
+	
+	if(p[pos] < 0x80)			{ extra = 0; }
+	else if(p[pos] < 0xc0)		{ return 0; }
+	else if(p[pos] < 0xe0)		{ extra = 1; number &= 0x1f; }
+	else if(p[pos] < 0xf0)		{ extra = 2; number &= 0x0f; }
+	else if(p[pos] < 0xf8)		{ extra = 3; number &= 0x07; }
+	else if(p[pos] < 0xfc)		{ extra = 4; number &= 0x03; }
+	else if(p[pos] < 0xfe)		{ extra = 5; number &= 0x01; }
+	else if(p[pos] == 0xfe)		{ extra = 6; number = 0; }
+	else						{ return 0; }
+	
+	pos++;
+	
+	for(int i=0; i < extra; i++, pos++)
+	{
+		if((p[pos] & 0xc0) != 0x80)
+			return 0;
+		
+		number = (number << 6) | (p[pos] & 0x3f);
+	}
+	
+	if(blocksize_code == 6)
+		pos += 1;
+	else if(blocksize_code == 7)
+		pos += 2;
+	
+	if(rate_code == 12)
+		pos += 1;
+	else if(rate_code == 13 || rate_code == 14)
+		pos += 2;
+	
+	if(flac_crc8(p, pos) != p[pos])
+		return 0;
+	
+	*sample = (variable ? number : number * fixed_blocksize);
+	
+	return pos + 1;
+}
+
+
+SeekIndex *
+SeekIndex::scan_flac(FileSource *source, ogg_int64_t spacing, Thread *thread, SeekIndex **resume)
+{
+	SeekIndex *index = resume_scan(resume, spacing);
+	
+	const ogg_int64_t size = source->get_size();
+	
+	unsigned char buf[64 * 1024];
+	
+	if(source->read(0, buf, 10) != 10)
+	{
+		delete index;
+		
+		return NULL;
+	}
+	
+	ogg_int64_t offset = flac_start(buf);
+	
+	// find the end of the metadata, and what we need from STREAMINFO
+	if(source->read(offset, buf, 4) != 4 || memcmp(buf, "fLaC", 4) != 0)
+	{
+		delete index;
+		
+		return NULL;
+	}
+	
+	offset += 4;
+	
+	unsigned fixed_blocksize = 0;
+	unsigned max_blocksize = 0;
+	unsigned min_framesize = 0;
+	int channels = 0;
+	int bits = 0;
+	ogg_int64_t total_samples = 0; // 0 if the encoder didn't know
+	
+	bool last = false;
+	
+	while(!last)
+	{
+		if(source->read(offset, buf, 4 + 34) != 4 + 34)
+		{
+			delete index;
+			
+			return NULL;
+		}
+		
+		last = (buf[0] & 0x80);
+		
+		const int type = (buf[0] & 0x7f);
+		const ogg_int64_t length = (buf[1] << 16) | (buf[2] << 8) | buf[3];
+		
+		if(type == FLAC__METADATA_TYPE_STREAMINFO)
+		{
+			const unsigned char *si = &buf[4];
+			
+			fixed_blocksize = (si[0] << 8) | si[1]; // the minimum, which is also the fixed size
+			max_blocksize = (si[2] << 8) | si[3];
+			min_framesize = (si[4] << 16) | (si[5] << 8) | si[6];
+			channels = ((si[12] >> 1) & 0x07) + 1;
+			bits = (((si[12] & 0x01) << 4) | (si[13] >> 4)) + 1;
+			total_samples = ((ogg_int64_t)(si[13] & 0x0f) << 32) |
+								((ogg_uint32_t)si[14] << 24) | (si[15] << 16) | (si[16] << 8) | si[17];
+		}
+		
+		offset += 4 + length;
+	}
+	
+	if(fixed_blocksize == 0 || max_blocksize < fixed_blocksize)
+	{
+		delete index;
+		
+		return NULL;
+	}
+	
+	
+	const int header_max = 16;
+	
+	ogg_int64_t last_sample = -1;
+	
+	if(index->_count > 0)
+	{
+		// start again at the last frame we kept, the one after it is the first that's new
+		offset = index->_last.offset;
+		last_sample = index->_last.sample;
+	}
+	
+	while(offset < size)
+	{
+		if(thread != NULL && thread->cancelled())
+		{
+			if(resume != NULL)
+				*resume = index;
+			else
+				delete index;
+			
+			return NULL;
+		}
+		
+		const size_t len = source->read(offset, buf, sizeof(buf));
+		
+		if(len < header_max)
+			break;
+		
+		int i = 0;
+		
+		while(i <= (int)len - header_max)
+		{
+			ogg_int64_t sample = 0;
+			
+			const int header_len = parse_flac_frame_header(&buf[i], len - i, fixed_blocksize, channels, bits, &sample);
+			
+			// Skipping ahead by min_framesize never skips a real frame, so the next one has to
+			// be no more than a block past the last.  Anything further is a false sync, which
+			// would otherwise make us throw away every real frame after it.
+			const bool expected = (sample > last_sample &&
+									sample <= (last_sample < 0 ? 0 : last_sample) + max_blocksize &&
+									(total_samples == 0 || sample < total_samples));
+			
+			if(header_len > 0 && expected)
+			{
+				index->add(sample, offset + i);
+				
+				last_sample = sample;
+				
+				i += (min_framesize > (unsigned)header_len ? min_framesize : header_len);
+			}
+			else
+				i++;
+		}
+		
+		offset += i;
+	}
+	
+	return index;
+}
+
+
+typedef struct
+{
+	char			magic[8];
+	FileIdentity	identity;
+	ogg_int64_t		spacing;
+	ogg_int64_t		points;
+	ogg_int64_t		bytes;
+} SeekIndexHeader; // followed by the points
+
+static const char g_index_magic[8] = { 'O', 'g', 'g', 'I', 'n', 'd', 'x', '2' };
+
+
+SeekIndex *
+SeekIndex::load(const PathString &path, const FileIdentity &identity)
+{
+	FILE *f = fopen_path(path, "rb");
+	
+	if(f == NULL)
+		return NULL;
+	
+	SeekIndexHeader header;
+	
+	std::vector<unsigned char> data;
+	
+	bool ok = fread(&header, sizeof(header), 1, f) == 1 &&
+				memcmp(header.magic, g_index_magic, sizeof(header.magic)) == 0 &&
+				header.identity == identity &&
+				header.points > 0 &&
+				header.bytes > 0 && header.bytes < identity.size;
+	
+	if(ok)
+	{
+		data.resize(header.bytes);
+		
+		ok = (fread(&data[0], 1, header.bytes, f) == (size_t)header.bytes);
+	}
+	
+	fclose(f);
+	
+	if(!ok)
+		return NULL;
+	
+	
+	// put the points back in one at a time, which gets us the checkpoints
+	SeekIndex *index = new SeekIndex(header.spacing);
+	
+	size_t pos = 0;
+	Point point = { 0, 0 };
+	
+	while(pos < data.size() && ok)
+	{
+		ok = read_point(data, &pos, &point);
+		
+		if(ok)
+			index->add(point.sample, point.offset);
+	}
+	
+	if(!ok || index->_count != (size_t)header.points)
+	{
+		delete index;
+		
+		return NULL;
+	}
+	
+	touch_file(path);
+	
+	return index;
+}
+
+
+void
+SeekIndex::save(const PathString &path, const FileIdentity &identity) const
+{
+	if( _data.empty() )
+		return;
+	
+	SeekIndexHeader header;
+	
+	memset(&header, 0, sizeof(header));
+	
+	memcpy(header.magic, g_index_magic, sizeof(header.magic));
+	header.identity = identity;
+	header.spacing = _spacing;
+	header.points = _count;
+	header.bytes = _data.size();
+	
+	FILE *f = fopen_path(path, "wb");
+	
+	if(f != NULL)
+	{
+		bool ok = (fwrite(&header, sizeof(header), 1, f) == 1 &&
+					fwrite(&_data[0], 1, _data.size(), f) == _data.size());
+		
+		if(fclose(f) != 0 || !ok)
+			delete_file(path);
+	}
+}
+
+
+bool
+SeekIndex::find(ogg_int64_t sample, Point *point) const
+{
+	if(_checkpoints.empty() || sample < _checkpoints.front().point.sample)
+		return false;
+	
+	// first checkpoint after sample, then back one
+	size_t low = 0, high = _checkpoints.size();
+	
+	while(low < high)
+	{
+		const size_t mid = (low + high) / 2;
+		
+		if(_checkpoints[mid].point.sample <= sample)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	
+	const Checkpoint &checkpoint = _checkpoints[low - 1];
+	
+	*point = checkpoint.point;
+	
+	size_t pos = checkpoint.pos;
+	
+	Point next = *point;
+	
+	while( read_point(_data, &pos, &next) && next.sample <= sample )
+		*point = next;
+	
+	return true;
+}
+
+
+// Clips being scanned right now, so two importer instances with the same clip
+// don't both do it
+static Mutex g_indexing_mutex;
+static std::set<FileIdentity> g_indexing;
+
+enum { MAX_INDEX_BUILDERS = 1 }; // it's mostly waiting on the disk, and one at a time is kinder to it
+
+
+IndexBuilder::IndexBuilder(const prUTF16Char *path, const FileIdentity &identity, bool flac,
+							ogg_int64_t spacing, const PathString &index_path) :
+	_identity(identity),
+	_flac(flac),
+	_spacing(spacing),
+	_index_path(index_path),
+	_index(NULL),
+	_partial(NULL)
+{
+	copy_path(path, _path);
+}
+
+
+IndexBuilder::~IndexBuilder()
+{
+	cancel();
+	
+	join();
+	
+	delete _index;
+	delete _partial;
+}
+
+
+IndexBuilder *
+IndexBuilder::create(const prUTF16Char *path, const FileIdentity &identity, bool flac,
+						ogg_int64_t spacing, const PathString &index_path, SeekIndex *resume)
+{
+	{
+		ScopedLock lock(g_indexing_mutex);
+		
+		if(g_indexing.size() >= MAX_INDEX_BUILDERS || g_indexing.find(identity) != g_indexing.end())
+			return NULL;
+		
+		g_indexing.insert(identity);
+	}
+	
+	IndexBuilder *builder = new IndexBuilder(path, identity, flac, spacing, index_path);
+	
+	builder->_partial = resume;
+	
+	if( !builder->start(true) )
+	{
+		builder->_partial = NULL; // still the caller's
+		
+		delete builder;
+		
+		ScopedLock lock(g_indexing_mutex);
+		
+		g_indexing.erase(identity);
+		
+		return NULL;
+	}
+	
+	return builder;
+}
+
+
+SeekIndex *
+IndexBuilder::take_index(SeekIndex **partial)
+{
+	assert( finished() );
+	
+	SeekIndex *index = _index;
+	
+	_index = NULL;
+	
+	*partial = _partial;
+	
+	_partial = NULL;
+	
+	return index;
+}
+
+
+void
+IndexBuilder::run()
+{
+	imFileRef fp = open_file(&_path[0]);
+	
+	FileIdentity identity;
+	
+	if(fp != imInvalidHandleValue && get_file_identity(fp, &_path[0], &identity) && identity == _identity)
+	{
+		BlockCache source(fp);
+		
+		_index = (_flac ? SeekIndex::scan_flac(&source, _spacing, this, &_partial) :
+							SeekIndex::scan_ogg(&source, _spacing, this, &_partial));
+		
+		if(_index != NULL && !_index_path.empty())
+			_index->save(_index_path, _identity);
+	}
+	else
+	{
+		// the file changed, or we can't get at it
+		delete _partial;
+		
+		_partial = NULL;
+	}
+	
+	if(fp != imInvalidHandleValue)
+		close_file(fp);
+	
+	ScopedLock lock(g_indexing_mutex);
+	
+	g_indexing.erase(_identity);
+}
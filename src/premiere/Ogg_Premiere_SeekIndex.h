@@ -0,0 +1,161 @@
+///////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Brendan Bolles
+// 
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// *	   Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+// *	   Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+///////////////////////////////////////////////////////////////////////////
+
+// ------------------------------------------------------------------------
+//
+// Seek index for the Ogg importer
+//
+// by Brendan Bolles <brendan@fnordware.com>
+//
+// ------------------------------------------------------------------------
+
+
+// The libraries seek by bisection, which means a dozen or so reads scattered around the
+// file, each one a round trip when the file is on a network.  Instead, we scan the file
+// once for where the Ogg pages or FLAC frames start, and go straight there.  We only keep
+// one every second or so, since decoding forward from there is cheap.  The scan happens
+// in the background, and the libraries do the seeking until it's done.
+
+
+#ifndef OGG_PREMIERE_SEEKINDEX_H
+#define OGG_PREMIERE_SEEKINDEX_H
+
+#include "Ogg_Premiere_Platform.h"
+
+
+class SeekIndex
+{
+  public:
+	typedef struct {
+		ogg_int64_t		sample;	// granule position before an Ogg page, first sample of a FLAC frame
+		ogg_int64_t		offset;	// where the page or frame starts in the file
+	} Point;
+	
+	// NULL if the file isn't something we can index (like a chained Ogg), or if the
+	// thread doing the scanning gets cancelled.  Points will be at least spacing apart.
+	// With resume, a cancelled scan leaves what it got done there, and a scan that
+	// finds one there picks up from its last point.
+	static SeekIndex * scan_ogg(FileSource *source, ogg_int64_t spacing, Thread *thread, SeekIndex **resume = NULL);
+	static SeekIndex * scan_flac(FileSource *source, ogg_int64_t spacing, Thread *thread, SeekIndex **resume = NULL);
+	
+	static SeekIndex * load(const PathString &path, const FileIdentity &identity);
+	void save(const PathString &path, const FileIdentity &identity) const;
+	
+	// the last point at or before sample, false if there isn't one
+	bool find(ogg_int64_t sample, Point *point) const;
+	
+  private:
+	SeekIndex(ogg_int64_t spacing) : _spacing(spacing), _count(0) { _last.sample = _last.offset = 0; }
+	
+	void add(ogg_int64_t sample, ogg_int64_t offset);
+	
+	// the partial index to carry on with, if there's one worth using
+	static SeekIndex * resume_scan(SeekIndex **resume, ogg_int64_t spacing);
+	
+	static bool read_point(const std::vector<unsigned char> &data, size_t *pos, Point *point);
+	
+	// Each point is stored as the difference from the one before, in variable-length
+	// integers.  That's usually 5 or 6 bytes, so 10 hours comes to 200 KB or so.
+	// Every so often we keep a decoded point too, so find() doesn't have to decode much.
+	enum { CHECKPOINT_INTERVAL = 32 };
+	
+	typedef struct {
+		Point	point;
+		size_t	pos; // in _data, right after this point
+	} Checkpoint;
+	
+	std::vector<unsigned char> _data;
+	std::vector<Checkpoint> _checkpoints;
+	
+	ogg_int64_t _spacing;
+	Point _last;
+	size_t _count;
+};
+
+
+// Scans the clip with its own file handle, at low priority.  Only a few of these run
+// at once for all the clips together, so a big project doesn't start a scan for every
+// clip it opens.  Clips that don't get one keep asking until one frees up.
+class IndexBuilder : public Thread
+{
+  public:
+	// NULL if we can't start one right now.  If resume has a scan that got stopped
+	// partway, we carry on from there, and it's ours once we've started.
+	static IndexBuilder * create(const prUTF16Char *path, const FileIdentity &identity, bool flac,
+									ogg_int64_t spacing, const PathString &index_path, SeekIndex *resume);
+	
+	virtual ~IndexBuilder(); // stops the thread if it's still going
+	
+	// Once it's finished, NULL if it didn't work out.  If it was cancelled, *partial
+	// gets what it had done, for the next builder to pick up.
+	SeekIndex * take_index(SeekIndex **partial);
+	
+  protected:
+	virtual void run();
+	
+  private:
+	IndexBuilder(const prUTF16Char *path, const FileIdentity &identity, bool flac,
+					ogg_int64_t spacing, const PathString &index_path);
+	
+	std::vector<prUTF16Char> _path;
+	const FileIdentity _identity;
+	const bool _flac;
+	const ogg_int64_t _spacing;
+	const PathString _index_path;
+	
+	SeekIndex *_index;
+	SeekIndex *_partial;
+};
+
+
+inline ogg_int64_t
+read_le64(const unsigned char *p)
+{
+	ogg_uint64_t val = 0;
+	
+	for(int i=7; i >= 0; i--)
+		val = (val << 8) | p[i];
+	
+	return val;
+}
+
+
+inline ogg_uint32_t
+read_le32(const unsigned char *p)
+{
+	return (p[0] | (p[1] << 8) | (p[2] << 16) | ((ogg_uint32_t)p[3] << 24));
+}
+
+
+// Where "fLaC" should be, given the first 10 bytes of the file (past any ID3v2 tag)
+ogg_int64_t flac_start(const unsigned char *head);
+
+
+#endif // OGG_PREMIERE_SEEKINDEX_H